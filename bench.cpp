@@ -0,0 +1,311 @@
+//benchmarks for the editor core. kilo.cpp is compiled in without its main
+//and the editor runs headless, drawing to the same byte counting sink as
+//--replay. every benchmark runs a few times and keeps its fastest run.
+//results go to a json file, one result per line, and are compared against
+//a baseline in the same format: a result slower than the baseline by more
+//than the threshold fails the run
+#define KILO_NO_MAIN
+#include "kilo.cpp"
+#include <malloc.h>
+
+struct benchResult {
+  std::string name;
+  double secs;
+  double mb;//megabytes of text handled, 0 when throughput means nothing
+  double bytes;//heap bytes per row, 0 when not measured
+  double out;//terminal bytes per frame, 0 when not measured
+};
+struct benchConfig {
+  std::string dir;//where the generated files go
+  std::vector<int> sizes;//MB, files editorOpen is measured on
+  int work;//MB, file the other benchmarks edit, search, draw and save
+  int runs;
+  double threshold;//percent slower than the baseline that counts as a regression
+  std::string out, baseline;
+};
+benchConfig B;
+std::vector<benchResult> results;
+
+void benchDie(const char *what){
+  perror(what);
+  exit(2);
+}
+//a C file of about mb megabytes. every line has a keyword, a number, a
+//string and a comment for the highlighter, "needle" is on one line in 100k
+std::string benchFile(int mb){
+  std::string path=B.dir+"/kilo-bench-"+std::to_string(mb)+"MB.c";
+  struct stat st;
+  size_t want=(size_t)mb<<20;
+  if(stat(path.c_str(),&st)==0&&(size_t)st.st_size>=want)return path;
+  FILE *fp=fopen(path.c_str(),"w");
+  if(!fp)benchDie(path.c_str());
+  char line[128];
+  size_t written=0;
+  for(long i=0;written<want;i++){
+    int n;
+    if(i%100000==50000)n=snprintf(line,sizeof(line),"static int needle = %ld; /* the one */\n",i);
+    else if(i%7==0)n=snprintf(line,sizeof(line),"  printf(\"row %%d\\n\", x%ld); // print it\n",i);
+    else n=snprintf(line,sizeof(line),"int x%ld = %ld; // c\n",i,i*31);
+    if(fwrite(line,1,n,fp)!=(size_t)n)benchDie(path.c_str());
+    written+=n;
+  }
+  if(fclose(fp)!=0)benchDie(path.c_str());
+  return path;
+}
+//opens path with the cursor and view back at the top
+void benchOpen(const std::string &path){
+  editorSaveCollect(true);
+  searchStop();
+  E.search.valid=false;
+  editorOpen(path.c_str());
+  E.cx=E.cy=E.rx=0;
+  E.rowoff=E.coloff=0;
+}
+//runs fn B.runs times after setup and records the fastest
+template<class S, class F> void benchRun(const std::string &name, double mb, S setup, F fn){
+  double best=-1;
+  for(int i=0;i<B.runs;i++){
+    setup();
+    double t0=loopNow();
+    fn();
+    double t=loopNow()-t0;
+    if(best<0||t<best)best=t;
+  }
+  benchResult r={name,best,mb,0,0};
+  results.push_back(r);
+  printf("%-24s %10.3f ms",name.c_str(),best*1e3);
+  if(mb>0)printf(" %10.1f MB/s",mb/best);
+  printf("\n");
+  fflush(stdout);
+}
+
+void benchOpenFiles(){
+  for(size_t i=0;i<B.sizes.size();i++){
+    std::string path=benchFile(B.sizes[i]);
+    benchRun("open_"+std::to_string(B.sizes[i])+"MB",B.sizes[i],[]{},[&]{ benchOpen(path); });
+  }
+}
+//types a line of text and breaks it with Enter, 100 times, at row at
+void benchType(const std::string &path, const char *where, double frac){
+  benchRun(std::string("type_")+where,0,[&]{ benchOpen(path); },[&]{
+    E.cy=(int)((E.numrows-1)*frac);
+    for(int n=0;n<100;n++){
+      E.cx=0;
+      for(const char *p="int y = 0; // typed";*p;p++)editorInsertChar(*p);
+      editorInsertNewline();
+    }
+  });
+}
+//highlights the first 100k rows, their render already built
+void benchSyntax(const std::string &path){
+  const int rows=100000;
+  benchOpen(path);
+  size_t bytes=0;
+  E.row.forEachLine(0,std::min(rows,E.numrows),[&](int,const char*,int len,erow*){
+    bytes+=len;
+    return true;
+  });
+  benchRun("syntax_100k_rows",bytes/1048576.0,[&]{
+    benchOpen(path);
+    E.row.forEach(0,rows,[](int,erow &row){
+      editorUpdateRender(&row);
+      return true;
+    });
+  },[&]{
+    int state=HLS_NORMAL;
+    E.row.forEach(0,rows,[&](int,erow &row){
+      editorUpdateSyntax(&row,state);
+      state=row.hl_open;
+      return true;
+    });
+  });
+}
+//loads, renders and highlights the first 100k rows, and measures the heap
+//they take as well as the time
+void benchRows(const std::string &path){
+  const int rows=100000;
+  size_t before=0,after=0;
+  auto heap=[]{
+    struct mallinfo2 m=mallinfo2();
+    return m.uordblks+m.hblkhd;//big blocks like the row pool's slabs are mmapped
+  };
+  benchRun("rows_100k",0,[&]{
+    benchOpen(path);
+    before=heap();
+  },[&]{
+    int state=HLS_NORMAL;
+    E.row.forEach(0,rows,[&](int,erow &row){
+      editorRenderRow(&row,state);
+      state=row.hl_open;
+      return true;
+    });
+    after=heap();
+  });
+  benchResult &r=results.back();
+  r.bytes=(double)(after-before)/std::min(rows,E.numrows);
+  printf("%-24s %10.1f bytes per row\n","",r.bytes);
+}
+void benchFind(const char *name, const char *query){
+  benchRun(name,B.work,[&]{ E.search.valid=false; },[&]{
+    editorSearchStart(query,false);
+    for(size_t i=0;i<E.search.workers.size();i++)E.search.workers[i].join();
+    E.search.workers.clear();
+    searchCollect();
+  });
+  printf("%-24s %zu matches\n","",E.search.matches.size());
+}
+//draws 200 frames, each scrolled a page further down so every row is new
+void benchDraw(const std::string &path){
+  benchRun("draw_200_frames",0,[&]{ benchOpen(path); E.screen.valid=false; },[&]{
+    for(int n=0;n<200;n++){
+      E.cy=E.rowoff=n*E.screenrows;
+      editorRefreshScreen();
+    }
+  });
+}
+//draws 200 frames, each scrolled one line further down, and measures the
+//bytes a terminal receives per frame
+void benchScroll(const std::string &path){
+  size_t bytes=0;
+  benchRun("scroll_200_lines",0,[&]{
+    benchOpen(path);
+    E.screen.valid=false;
+    editorRefreshScreen();
+    bytes=0;
+  },[&]{
+    for(int n=1;n<=200;n++){
+      E.cy=E.rowoff=n;
+      editorRefreshScreen();
+      bytes+=E.framebytes;
+    }
+  });
+  benchResult &r=results.back();
+  r.out=bytes/200.0;
+  printf("%-24s %10.1f bytes per frame\n","",r.out);
+}
+void benchSave(const std::string &path){
+  std::string copy=B.dir+"/kilo-bench-save.c";
+  benchRun("save_"+std::to_string(B.work)+"MB",B.work,[&]{
+    benchOpen(path);
+    free(E.filename);
+    E.filename=strdup(copy.c_str());
+    editorInsertChar('x');//so the rows are not all still in the map
+  },[&]{
+    editorSave();
+    editorSaveCollect(true);
+  });
+  unlink(copy.c_str());
+}
+
+//reads a results file written by benchWrite
+std::map<std::string,double> benchRead(const std::string &path){
+  std::map<std::string,double> m;
+  FILE *fp=fopen(path.c_str(),"r");
+  if(!fp)return m;
+  char line[256],name[128];
+  double secs;
+  while(fgets(line,sizeof(line),fp)){
+    if(sscanf(line," {\"name\": \"%127[^\"]\", \"seconds\": %lf",name,&secs)==2)m[name]=secs;
+  }
+  fclose(fp);
+  return m;
+}
+void benchWrite(const std::string &path){
+  FILE *fp=fopen(path.c_str(),"w");
+  if(!fp)benchDie(path.c_str());
+  fprintf(fp,"[\n");
+  for(size_t i=0;i<results.size();i++){
+    const benchResult &r=results[i];
+    fprintf(fp,"  {\"name\": \"%s\", \"seconds\": %.6f",r.name.c_str(),r.secs);
+    if(r.mb>0)fprintf(fp,", \"mb_per_s\": %.1f",r.mb/r.secs);
+    if(r.bytes>0)fprintf(fp,", \"bytes_per_row\": %.1f",r.bytes);
+    if(r.out>0)fprintf(fp,", \"bytes_per_frame\": %.1f",r.out);
+    fprintf(fp,"}%s\n",i+1<results.size()?",":"");
+  }
+  fprintf(fp,"]\n");
+  fclose(fp);
+}
+//returns the number of regressions
+int benchCompare(){
+  std::map<std::string,double> base=benchRead(B.baseline);
+  if(base.empty()){
+    benchWrite(B.baseline);
+    printf("no baseline yet, saved this run to %s\n",B.baseline.c_str());
+    return 0;
+  }
+  int bad=0;
+  printf("\n%-24s %10s %10s %8s\n","vs baseline","base ms","now ms","change");
+  for(size_t i=0;i<results.size();i++){
+    std::map<std::string,double>::iterator it=base.find(results[i].name);
+    if(it==base.end())continue;
+    double change=(results[i].secs/it->second-1)*100;
+    bool slow=change>B.threshold;
+    if(slow)bad++;
+    printf("%-24s %10.3f %10.3f %+7.1f%%%s\n",results[i].name.c_str(),it->second*1e3,
+      results[i].secs*1e3,change,slow?"  REGRESSION":"");
+  }
+  return bad;
+}
+
+int main(int argc, char *argv[]){
+  B.dir=getenv("TMPDIR")?getenv("TMPDIR"):"/tmp";
+  B.sizes={1,100,1024};
+  B.work=100;
+  B.runs=3;
+  B.threshold=15;
+  B.out="bench.json";
+  for(int i=1;i<argc;i++){
+    std::string a=argv[i];
+    const char *v=i+1<argc?argv[i+1]:NULL;
+    if(a=="--out"&&v)B.out=argv[++i];
+    else if(a=="--baseline"&&v)B.baseline=argv[++i];
+    else if(a=="--threshold"&&v)B.threshold=atof(argv[++i]);
+    else if(a=="--runs"&&v)B.runs=atoi(argv[++i]);
+    else if(a=="--dir"&&v)B.dir=argv[++i];
+    else if(a=="--work"&&v)B.work=atoi(argv[++i]);
+    else if(a=="--sizes"&&v){
+      B.sizes.clear();
+      for(char *p=argv[++i];*p;){
+        B.sizes.push_back(strtol(p,&p,10));
+        if(*p==',')p++;
+        else if(*p)break;
+      }
+    }else{
+      fprintf(stderr,"usage: %s [--out FILE] [--baseline FILE] [--threshold PCT] [--runs N]\n"
+        "          [--sizes MB,MB,...] [--work MB] [--dir DIR]\n",argv[0]);
+      return 2;
+    }
+  }
+  if(B.runs<1)B.runs=1;
+  if(B.work<1)B.work=1;
+
+  //headless, as for --replay: a virtual screen and output that is only counted
+  T.record=-1;
+  T.replay=true;
+  T.rows=50;
+  T.cols=120;
+  initEditor();
+  loopInit();
+  L.fps=0;
+  E.hl_async=0;
+
+  benchOpenFiles();
+  std::string work=benchFile(B.work);
+  benchType(work,"top",0);
+  benchType(work,"middle",0.5);
+  benchType(work,"bottom",1);
+  benchSyntax(work);
+  benchRows(work);
+  benchFind("find_dense","x1");
+  benchFind("find_sparse","needle");
+  benchDraw(work);
+  benchScroll(work);
+  benchSave(work);
+
+  benchWrite(B.out);
+  printf("results written to %s\n",B.out.c_str());
+  if(B.baseline.empty())return 0;
+  int bad=benchCompare();
+  if(bad)printf("%d benchmark%s slower than the baseline by more than %.0f%%\n",bad,bad>1?"s":"",B.threshold);
+  return bad?1:0;
+}
@@ -8,22 +8,52 @@
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 #include <iostream>
 #include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#if defined(__SSE2__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_INDEX_CHUNK (8 << 20)//bytes of file each line indexing thread scans
+#define KILO_SEARCH_CHUNK (1 << 20)//bytes of text per unit of search work
+#define KILO_SEARCH_MAX (4 << 20)//matches kept before the rest of a search is given up, fewer on a small budget
+#define KILO_UNDO_MAX (64 << 20)//bytes of undo history kept, oldest steps go first
+#define KILO_MEM_BUDGET (512 << 20)//bytes of memory to stay under, --budget MB changes it
+#define KILO_PAGE_BLOCK (16 << 10)//bytes of a paged file per line index entry
+#define KILO_LONG_ROW (16 << 10)//bytes from which a row gets a column index
+#define KILO_HL_MARK 1024//rows between the lexer states kept in E.hl_marks
+#define KILO_COL_CHUNK (4 << 10)//bytes of a long row per column index entry
+#define KILO_INPUT_BUF (64 << 10)//bytes of terminal input one read may take
+#define KILO_FPS 60//redraws per second at most
+#define KILO_ESC_WAIT 100//ms to wait for the rest of an escape sequence
+#define KILO_PASTE_WAIT 1000//ms of silence after which a paste missing its end is taken as is
+#define KILO_MSG_SECS 5//seconds a status message stays up
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 
@@ -37,31 +67,684 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_KEY,//not a key: a bracketed paste, its text is in IN.paste
+  REDRAW_KEY//not a key: background work finished and the screen should be redrawn
 };
 enum editorHighlight{
   HL_NORMAL=0,
   HL_COMMENT,
   HL_STRING,
   HL_NUMBER,//every character that's part of a number will have that
+  HL_MLCOMMENT,
+  HL_KEYWORD1,//statements and other reserved words
+  HL_KEYWORD2,//type names
   HL_MATCH
 };
+//lexer state carried from the end of one row into the next
+enum editorLexState{
+  HLS_NORMAL=0,
+  HLS_COMMENT,//inside a multi-line comment
+  //any other value is the quote char of a string continued with a trailing backslash
+};
+//where the lexer stopped inside a row, enough to go on from there
+struct lexstop {
+  int at;//next byte to look at
+  int state;//HLS_COMMENT, or the quote char of an open string
+  int flags;
+};
+#define LEX_LINE_COMMENT (1 << 0)//a single line comment runs to the end of the row
+#define LEX_AFTER_WORD (1 << 1)//the byte before at is not a separator
+#define LEX_AFTER_NUMBER (1 << 2)//the byte before at is part of a number
+#define LEX_CONTINUED (1 << 3)//the row ends in the backslash of an open string
+#define LEX_LOOKAHEAD 16//bytes past where it stops the lexer may have read to finish a token
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 /*** data ***/
+typedef void (*lexFn)(const char *text, int len, int to, lexstop *st, unsigned char *hl);
 struct editorSyntax{
-  char *filetype;
-  char **filematch;//array of file extensions
-  char *singleline_comment_start;
-  int flags;//bit field, will contain flag for highlighting numbers or strings
+  const char *filetype;
+  const char **filematch;//array of file extensions
+  lexFn lex;//the lexer instantiated for the language, see lexRun
+
+};
+struct rowcols;
+void killswitch(const char *s);
+//row nodes and the text, render and hl spans of rows are carved out of
+//slabs tied to the buffer instead of taking a malloc each. freed blocks go
+//on a free list for their size class, and dropping all rows of the buffer
+//hands back the slabs without visiting the rows. blocks too big for a
+//class are malloced, linked in a list so they can still be dropped then
+#define POOL_SLAB (256 << 10)
+#define POOL_CLASSES 24
+#define POOL_MAX 4096//biggest class
+#define POOL_KEEP 16//slabs a reset keeps for the next file, they are already paged in
+//the header's size is a multiple of 16, so the block after it keeps the
+//alignment malloc gave the header
+struct alignas(16) poolbig {
+  poolbig *prev, *next;
+};
+struct rowpool {
+  std::vector<char*> slabs;
+  size_t used;//slabs handed out from, the rest are kept from before a reset
+  char *next, *end;//what is left of the newest slab
+  void *free[POOL_CLASSES];//first free block of every class, each holds the next
+  poolbig *big;
+  size_t bytes;//handed out and not freed, reported after a replay
+};
+rowpool RP;
+//classes go up by 16 bytes to 256, then by half or a third
+const unsigned poolTop[POOL_CLASSES-16]={384,512,768,1024,1536,2048,3072,POOL_MAX};
 
+int poolClass(size_t n){
+  if(n<=256)return n<=16?0:(n-1)/16;
+  int k=0;
+  while(poolTop[k]<n)k++;
+  return 16+k;
+}
+size_t poolClassSize(int k){
+  return k<16?16*(k+1):poolTop[k-16];
+}
+//bytes a block asked for as n really has room for
+size_t poolRound(size_t n){ return n>POOL_MAX?n:poolClassSize(poolClass(n)); }
+void *poolAlloc(size_t n){
+  RP.bytes+=n;
+  if(n>POOL_MAX){
+    poolbig *b=(poolbig*)malloc(sizeof(poolbig)+n);
+    if(!b)killswitch("malloc");
+    b->prev=NULL;
+    b->next=RP.big;
+    if(RP.big)RP.big->prev=b;
+    RP.big=b;
+    return b+1;
+  }
+  int k=poolClass(n);
+  if(RP.free[k]){
+    void *p=RP.free[k];
+    RP.free[k]=*(void**)p;
+    return p;
+  }
+  size_t size=poolClassSize(k);
+  if((size_t)(RP.end-RP.next)<size){
+    if(RP.used==RP.slabs.size()){
+      char *slab=(char*)malloc(POOL_SLAB);
+      if(!slab)killswitch("malloc");
+      RP.slabs.push_back(slab);
+    }
+    RP.next=RP.slabs[RP.used++];
+    RP.end=RP.next+POOL_SLAB;
+  }
+  void *p=RP.next;
+  RP.next+=size;
+  return p;
+}
+//n is what the block was asked for with
+void poolFree(void *p, size_t n){
+  if(!p)return;
+  RP.bytes-=n;
+  if(n>POOL_MAX){
+    poolbig *b=(poolbig*)p-1;
+    if(b->prev)b->prev->next=b->next;
+    else RP.big=b->next;
+    if(b->next)b->next->prev=b->prev;
+    free(b);
+    return;
+  }
+  int k=poolClass(n);
+  *(void**)p=RP.free[k];
+  RP.free[k]=p;
+}
+//frees every block at once. nothing may point into the pool any more
+void poolReset(){
+  for(size_t i=POOL_KEEP;i<RP.slabs.size();i++)free(RP.slabs[i]);
+  if(RP.slabs.size()>POOL_KEEP)RP.slabs.resize(POOL_KEEP);
+  RP.used=0;
+  RP.next=RP.end=NULL;
+  memset(RP.free,0,sizeof(RP.free));
+  while(RP.big){
+    poolbig *b=RP.big;
+    RP.big=b->next;
+    free(b);
+  }
+  RP.bytes=0;
+}
+//text of a row. a row read from the mapped file only points at its line
+//there until it is changed, then it gets a copy: inline when it is short,
+//in a heap block of its own otherwise
+#define ROWTEXT_INLINE 8
+#define ROWTEXT_VIEW -1
+struct rowtext {
+  union {
+    char in[ROWTEXT_INLINE];
+    char *own;
+    const char *view;
+  };
+  int len;
+  int cap;//bytes in own, 0 while inline, ROWTEXT_VIEW for a view of the map
+  rowtext():len(0),cap(0){}
+  rowtext(const rowtext &o):len(0),cap(0){
+    if(o.cap==ROWTEXT_VIEW)point(o.view,o.len);
+    else assign(o.data(),o.len);
+  }
+  rowtext &operator=(const rowtext &)=delete;
+  ~rowtext(){ if(cap>0)poolFree(own,cap); }
+  const char *data() const { return cap==0?in:cap==ROWTEXT_VIEW?view:own; }
+  int size() const { return len; }
+  char operator[](int i) const { return data()[i]; }
+  std::string substr(int at) const { return std::string(data()+at,len-at); }
+  void point(const char *s, int n){
+    if(cap>0)poolFree(own,cap);
+    view=s;
+    len=n;
+    cap=ROWTEXT_VIEW;
+  }
+  void assign(const char *s, int n){
+    if(cap>0)poolFree(own,cap);
+    len=cap=0;
+    insert(0,s,n);
+  }
+  void insert(int at, const char *s, int n){
+    const char *old=data();
+    int need=len+n;
+    if(cap>=need||(cap==0&&need<=ROWTEXT_INLINE)){
+      char *p=cap>0?own:in;
+      std::string keep;
+      if(s>=old&&s<old+len)s=keep.assign(s,n).data();//inserting a piece of itself
+      memmove(p+at+n,p+at,len-at);
+      memcpy(p+at,s,n);
+      len=need;
+      return;
+    }
+    char buf[ROWTEXT_INLINE],*p=buf;
+    int ncap=0;
+    if(need>ROWTEXT_INLINE){
+      ncap=poolRound(cap>0?std::max(need,cap+cap/2):need);//a row being typed in grows by half
+      p=(char*)poolAlloc(ncap);
+    }
+    memcpy(p,old,at);
+    memcpy(p+at,s,n);
+    memcpy(p+at+n,old+at,len-at);
+    if(cap>0)poolFree(own,cap);
+    if(ncap)own=p;
+    else memcpy(in,buf,need);
+    len=need;
+    cap=ncap;
+  }
+  void erase(int at, int n){
+    if(cap==ROWTEXT_VIEW){
+      const char *old=view;
+      int was=len;
+      len=cap=0;
+      insert(0,old,at);
+      insert(at,old+at+n,was-at-n);
+      return;
+    }
+    char *p=cap>0?own:in;
+    memmove(p+at,p+at+n,len-at-n);
+    len-=n;
+  }
+};
+//highlight classes are kept as runs of one class. text between runs is plain
+struct hlspan {
+  int start;//render column
+  unsigned short len;
+  unsigned char hl;
 };
+#define HL_INLINE 2//spans kept in the row itself instead of a heap block
 struct erow {
   int size;
   int rsize; // render size
-  std::string chars;
-  std::string render;
-  unsigned char * hl;
+  rowtext chars;
+  char *render;//tab-expanded text, NULL when the row has no tabs and chars is drawn as it is
+  union {
+    hlspan *hl;
+    hlspan hlin[HL_INLINE];
+  };
+  int nhl;//spans in hl, or in hlin when there are no more than HL_INLINE
+  int hlgen;//E.hlgen when render and hl were built, 0 once chars changed
+  int hl_start;//lexer state hl was built from
+  int hl_open;//lexer state at the end of the row
+  int stategen;//E.hlgen when hl_open was computed, hl_open is unknown otherwise
+  unsigned hl_job;//highlight worker job building hl for the current render, 0 if none
+  rowcols *cols;//rows of KILO_LONG_ROW bytes or more: column index, render is a slice
+};
+/*** row storage ***/
+//rows live in an implicit treap (a balanced rope of lines). every node holds
+//either one erow or a lazy span of lines that still sit untouched in the mapped
+//file, and knows how many rows are in its subtree, so finding, inserting and
+//erasing row n costs O(log n) and never shifts the rows after it.
+//
+//a snapshot is just the root at some moment. taking one freezes every node
+//that exists (its epoch is older than ropeEpoch), and from then on a frozen
+//node is copied along with its path from the root instead of being changed,
+//and retired instead of being freed, until the snapshot is released.
+//render, hl, the column index and the lexer state are caches the snapshot never reads, so the
+//draw path may still fill them in on frozen nodes
+struct rownode {
+  rownode *left, *right;
+  unsigned prio;//heap priority, random so the tree stays balanced
+  int count;//rows in this subtree
+  int lines;//rows held by this node: 1 for a real row, more for a lazy span
+  int first;//lazy spans: line number in the mapped file, -1 for real rows
+  int orig;//real rows: the line of the mapped file they still hold unchanged,
+           //-1 once edited or for rows that were never in the file
+  unsigned epoch;//ropeEpoch when the node was made
+  erow row;
+};
+unsigned ropeEpoch=0;
+bool ropeShared=false;//a snapshot is alive, nodes older than ropeEpoch are frozen
+std::vector<rownode*> ropeRetired;//frozen nodes no longer in the live tree
+int colsLive=0;//rows with a column index, which lives outside the pool
+const char *editorLazyLine(int line, int *len);
+void editorLoadRow(erow *row, int line);
+void editorRowFreeCaches(erow *row);
+
+unsigned ropeRand(){//xorshift, only used for treap priorities
+  static unsigned s=2463534242u;
+  s^=s<<13;
+  s^=s>>17;
+  s^=s<<5;
+  return s;
+}
+rownode *ropeNewNode(int first, int lines){
+  rownode *n=new(poolAlloc(sizeof(rownode))) rownode();
+  n->prio=ropeRand();
+  n->lines=lines;
+  n->count=lines;
+  n->first=first;
+  n->orig=-1;
+  n->epoch=ropeEpoch;
+  return n;
+}
+//t if it may be changed, otherwise a copy of it that takes over its caches.
+//the caller puts the copy where t was
+rownode *ropeOwn(rownode *t){
+  if(!ropeShared||!t||t->epoch>=ropeEpoch)return t;
+  rownode *n=new(poolAlloc(sizeof(rownode))) rownode(*t);
+  n->epoch=ropeEpoch;
+  t->row.render=NULL;
+  t->row.nhl=0;
+  t->row.hl_job=0;
+  t->row.cols=NULL;
+  ropeRetired.push_back(t);
+  return n;
+}
+int ropeCount(rownode *t){ return t?t->count:0; }
+//rough bytes a clean row takes. its text is a view of the map, so that is
+//the node and some render and hl
+size_t ropeRowCost(rownode *t){ return sizeof(rownode)+(size_t)t->row.size/4; }
+void ropeUpdate(rownode *t){
+  t->count=t->lines+ropeCount(t->left)+ropeCount(t->right);
+}
+rownode *ropeMerge(rownode *l, rownode *r){
+  if(!l)return r;
+  if(!r)return l;
+  if(l->prio>r->prio){
+    l=ropeOwn(l);
+    l->right=ropeMerge(l->right,r);
+    ropeUpdate(l);
+    return l;
+  }
+  r=ropeOwn(r);
+  r->left=ropeMerge(l,r->left);
+  ropeUpdate(r);
+  return r;
+}
+//split t so that the first k rows end up in *l and the rest in *r,
+//cutting a lazy span in two when k falls inside it
+void ropeSplit(rownode *t, int k, rownode **l, rownode **r){
+  if(!t){ *l=*r=NULL; return; }
+  t=ropeOwn(t);
+  int lc=ropeCount(t->left);
+  if(k<=lc){
+    ropeSplit(t->left,k,l,&t->left);
+    *r=t;
+  }else if(k>=lc+t->lines){
+    ropeSplit(t->right,k-lc-t->lines,&t->right,r);
+    *l=t;
+  }else{
+    int head=k-lc;
+    rownode *tail=ropeNewNode(t->first+head,t->lines-head);
+    t->lines=head;
+    *r=ropeMerge(tail,t->right);
+    t->right=NULL;
+    *l=t;
+  }
+  ropeUpdate(t);
+}
+void ropeDelete(rownode *t){
+  editorRowFreeCaches(&t->row);
+  t->~rownode();
+  poolFree(t,sizeof(rownode));
+}
+void ropeFree(rownode *t){
+  if(!t)return;
+  ropeFree(t->left);
+  ropeFree(t->right);
+  if(ropeShared&&t->epoch<ropeEpoch){
+    ropeRetired.push_back(t);//a snapshot still reads it
+    return;
+  }
+  ropeDelete(t);
+}
+//builds a tree of the nodes, kept in order, in one pass: each node goes on
+//the right spine below the last node with a higher priority
+int ropeFixCounts(rownode *t){
+  if(!t)return 0;
+  t->count=t->lines+ropeFixCounts(t->left)+ropeFixCounts(t->right);
+  return t->count;
+}
+rownode *ropeBuild(const std::vector<rownode*> &nodes){
+  std::vector<rownode*> spine;
+  for(size_t i=0;i<nodes.size();i++){
+    rownode *n=nodes[i],*below=NULL;
+    while(!spine.empty()&&spine.back()->prio<n->prio){
+      below=spine.back();
+      spine.pop_back();
+    }
+    n->left=below;
+    if(!spine.empty())spine.back()->right=n;
+    spine.push_back(n);
+  }
+  if(spine.empty())return NULL;
+  ropeFixCounts(spine[0]);
+  return spine[0];
+}
+//copies the frozen nodes on the path to row k, returns the new subtree root
+rownode *ropeOwnPath(rownode *t, int k){
+  t=ropeOwn(t);
+  int lc=ropeCount(t->left);
+  if(k<lc)t->left=ropeOwnPath(t->left,k);
+  else if(k>=lc+t->lines)t->right=ropeOwnPath(t->right,k-lc-t->lines);
+  return t;
+}
+//frees what the snapshot kept alive, once nothing reads it any more
+void ropeRelease(){
+  for(size_t i=0;i<ropeRetired.size();i++)ropeDelete(ropeRetired[i]);
+  ropeRetired.clear();
+  ropeShared=false;
+}
+//calls fn(index,node) for every node overlapping rows [from,to) in order,
+//index being the row number of the node's first line. stops when fn returns false
+template<class F> bool ropeWalk(rownode *t, int base, int from, int to, F &fn){
+  if(!t||from>=to)return true;
+  int mid=base+ropeCount(t->left);
+  if(from<mid&&!ropeWalk(t->left,base,from,to,fn))return false;
+  if(mid<to&&mid+t->lines>from&&!fn(mid,t))return false;
+  if(to>mid+t->lines)return ropeWalk(t->right,mid+t->lines,from,to,fn);
+  return true;
+}
+//same as ropeWalk but visits the nodes from the last one to the first
+template<class F> bool ropeWalkBack(rownode *t, int base, int from, int to, F &fn){
+  if(!t||from>=to)return true;
+  int mid=base+ropeCount(t->left);
+  if(to>mid+t->lines&&!ropeWalkBack(t->right,mid+t->lines,from,to,fn))return false;
+  if(mid<to&&mid+t->lines>from&&!fn(mid,t))return false;
+  if(from<mid)return ropeWalkBack(t->left,base,from,to,fn);
+  return true;
+}
+
+//calls fn(index,chars,len,row) for rows [from,to) of the tree at root without
+//loading lazy rows, row is NULL for lines that are only in the mapped file
+template<class F> void ropeEachLine(rownode *root, int from, int to, F fn) {
+  auto visit=[&](int at, rownode *t){
+    if(t->first<0)return fn(at,t->row.chars.data(),t->row.size,&t->row);
+    int lo=at>from?at:from;
+    int hi=at+t->lines<to?at+t->lines:to;
+    for(int i=lo;i<hi;i++){
+      int len;
+      const char *s=editorLazyLine(t->first+i-at,&len);
+      if(!fn(i,s,len,(erow*)NULL))return false;
+    }
+    return true;
+  };
+  ropeWalk(root,0,from,to,visit);
+}
+
+struct rowrope {
+  rownode *root;
+  size_t clean;//ropeRowCost of the real rows that still hold their line unchanged
+
+  rowrope() : root(NULL), clean(0) {}
+  ~rowrope() { ropeFree(root); }
+
+  int size() const { return ropeCount(root); }
+
+  //drops every row and replaces them with one lazy span of the mapped file.
+  //unless a snapshot or a column index still needs them, all the rows go
+  //with the pool at once
+  void load(int lines) {
+    if(!ropeShared&&colsLive==0)poolReset();
+    else ropeFree(root);
+    root=lines>0?ropeNewNode(0,lines):NULL;
+    clean=0;
+  }
+  //the node holding row at
+  rownode *node(int at) {
+    rownode *t=root;
+    int k=at;
+    while(true){
+      int lc=ropeCount(t->left);
+      if(k<lc){
+        t=t->left;
+      }else if(k<lc+t->lines){
+        return t;
+      }else{
+        k-=lc+t->lines;
+        t=t->right;
+      }
+    }
+  }
+  //returns row at, reading it from the mapped file first if it is still lazy
+  erow &operator[](int at) {
+    rownode *t=node(at);
+    if(t->first<0)return t->row;
+    //cut the one line out of its span and turn it into a real row
+    rownode *l,*mid,*r;
+    ropeSplit(root,at,&l,&r);
+    ropeSplit(r,1,&mid,&r);
+    mid=ropeOwn(mid);
+    editorLoadRow(&mid->row,mid->first);
+    mid->orig=mid->first;
+    mid->first=-1;
+    clean+=ropeRowCost(mid);
+    root=ropeMerge(ropeMerge(l,mid),r);
+    return mid->row;
+  }
+  //row at for changing its text. reading goes through operator[], which
+  //leaves rows shared with a snapshot alone
+  erow &edit(int at) {
+    (*this)[at];
+    root=ropeOwnPath(root,at);
+    rownode *t=node(at);
+    if(t->orig>=0){
+      clean-=ropeRowCost(t);
+      t->orig=-1;
+    }
+    return t->row;
+  }
+  //the rows as they are now, unaffected by later changes until ropeRelease.
+  //only one snapshot is alive at a time
+  rownode *snapshot() {
+    ropeEpoch++;
+    ropeShared=true;
+    return root;
+  }
+  //inserts an empty row so that it becomes row number at
+  erow &insert(int at) {
+    rownode *n=ropeNewNode(-1,1);
+    rownode *l,*r;
+    ropeSplit(root,at,&l,&r);
+    root=ropeMerge(ropeMerge(l,n),r);
+    return n->row;
+  }
+  //inserts the real rows of nodes, in order, so that the first becomes row at
+  void insertNodes(int at, const std::vector<rownode*> &nodes) {
+    rownode *l,*r;
+    ropeSplit(root,at,&l,&r);
+    root=ropeMerge(ropeMerge(l,ropeBuild(nodes)),r);
+  }
+  void erase(int at) {
+    rownode *l,*mid,*r;
+    ropeSplit(root,at,&l,&r);
+    ropeSplit(r,1,&mid,&r);
+    if(mid->orig>=0)clean-=ropeRowCost(mid);
+    ropeFree(mid);
+    root=ropeMerge(l,r);
+  }
+  //turns rows [at,at+lines), real rows that still hold their line and lazy
+  //spans, back into one lazy span starting at line first of the mapped file
+  void collapse(int at, int lines, int first) {
+    rownode *l,*mid,*r;
+    ropeSplit(root,at,&l,&r);
+    ropeSplit(r,lines,&mid,&r);
+    auto uncount=[&](int,rownode *t){
+      if(t->orig>=0)clean-=ropeRowCost(t);
+      return true;
+    };
+    ropeWalk(mid,0,0,lines,uncount);
+    ropeFree(mid);
+    root=ropeMerge(ropeMerge(l,ropeNewNode(first,lines)),r);
+  }
+  //calls fn(index,row) for rows [from,to), loading lazy rows on the way.
+  //meant for small ranges like the visible screen
+  template<class F> void forEach(int from, int to, F fn) {
+    if(to>size())to=size();
+    for(int at=from;at<to;at++)(*this)[at];
+    auto visit=[&](int at, rownode *t){ return fn(at,t->row); };
+    ropeWalk(root,0,from,to,visit);
+  }
+  //calls fn(index,chars,len,row) for rows [from,to) without loading lazy rows
+  template<class F> void forEachLine(int from, int to, F fn) {
+    ropeEachLine(root,from,to,fn);
+  }
+  //forEachLine backwards, from row to-1 down to row from
+  template<class F> void forEachLineBack(int from, int to, F fn) {
+    auto visit=[&](int at, rownode *t){
+      if(t->first<0)return fn(at,t->row.chars.data(),t->row.size,&t->row);
+      int lo=at>from?at:from;
+      int hi=at+t->lines<to?at+t->lines:to;
+      for(int i=hi-1;i>=lo;i--){
+        int len;
+        const char *s=editorLazyLine(t->first+i-at,&len);
+        if(!fn(i,s,len,(erow*)NULL))return false;
+      }
+      return true;
+    };
+    ropeWalkBack(root,0,from,to,visit);
+  }
+  //calls fn(index,node) for every node holding rows of [from,to), whole lazy
+  //spans included. index is the node's first row and may be below from
+  template<class F> void forEachNode(int from, int to, F fn) {
+    ropeWalk(root,0,from,to,fn);
+  }
+};
+
+/*** screen ***/
+//a copy of what the terminal shows, one cell per column, so a refresh only
+//sends the spans of the frame that differ from the previous one
+#define ATTR_INVERSE 0x80//attr is 0 (default) or an SGR foreground color, plus this bit
+struct scell {
+  char ch;
+  unsigned char attr;
+};
+struct editorScreen {
+  int rows, cols;
+  std::vector<scell> shown;//cells currently on the terminal
+  std::vector<scell> next;//the frame being drawn
+  int attr;//attr the terminal is currently drawing with
+  bool valid;//false until the terminal was cleared to match shown
+  int rowoff, coloff;//the view the text lines in shown were drawn at
+};
+
+/*** search ***/
+struct searchmatch {
+  int row;
+  int col;//offset into chars
+  int len;
+};
+struct reprog;
+//a stretch of text the search workers scan without touching the rope: one
+//real row, or lines [first,first+lines) of the mapped file
+struct searchpiece {
+  int at;//row of the first line
+  int lines;
+  int first;//line in the mapped file, -1 for a real row
+  const char *s;
+  size_t len;
+};
+//pieces [lo,hi), handed to one worker at a time
+struct searchunit {
+  int lo, hi;
+  std::string query;//query hits are complete for, empty while they are not
+                    //or when the unit gave up at max matches
+  bool regex;//query was a regex
+  std::vector<searchmatch> hits;
+  bool narrow;//hits were found for a prefix of the query and only need filtering
+  std::atomic<bool> done;
+};
+struct editorSearch {
+  std::string query;//query being searched for
+  bool regex;//query is a regex, toggled with Ctrl-R in the prompt
+  reprog *re;//query compiled, in regex mode
+  std::vector<searchmatch> matches;//matches of the finished leading units, sorted by row then col
+  unsigned long edits;//E.edits when pieces was built
+  bool valid;//pieces and units describe the text, and no scan was abandoned half way
+  bool active;//the find prompt is open and matches on screen are highlighted
+  int current;//match the cursor is on, -1 before the first jump
+  int origin_row, origin_col;//cursor when the prompt was opened
+  std::vector<searchpiece> pieces;
+  std::vector<searchunit*> units;
+  size_t merged;//units whose hits are in matches
+  bool truncated;//a unit gave up, matches ends before the end of the text
+  std::atomic<size_t> stored;//hits kept by the units of this search so far
+  size_t max;//hits kept before the search gives up, set with the budget
+  std::atomic<size_t> next;//next unit for a worker to take
+  std::atomic<bool> cancel;
+  std::vector<std::thread> workers;
+};
+
+/*** undo ***/
+//every change to the text is one of four primitive operations, logged with
+//the text it adds or removes. the text goes into an append-only arena and
+//the log only ever grows at the end, so recording costs the size of the
+//change and undoing a paste costs the size of the paste
+enum undoKind {
+  UNDO_INSERT,//text inserted into row at col
+  UNDO_DELETE,//text deleted from row at col
+  UNDO_ROW_INSERT,//row inserted holding text
+  UNDO_ROW_DELETE//row holding text deleted
+};
+struct undoop {
+  unsigned char kind;
+  bool back;//UNDO_DELETE: a run of backspaces, its text is stored last char first
+  int row, col;
+  unsigned long step;//keypress the op belongs to, a step is undone as a whole
+  size_t off, len;//text in the arena, off counts from the start of the history
+  int bx, by;//cursor before the step, kept on its first op
+  int ax, ay;//cursor after the step, kept on its last op
+};
+struct editorHistory {
+  std::vector<undoop> ops;//ops[first..done) can be undone, ops[done..] redone
+  size_t first;//ops before this one were dropped to stay under max
+  size_t done;
+  std::string text;//arena, text[0] is at offset base
+  size_t base;
+  size_t max;//bytes of ops and text kept
+  unsigned long step;//bumped by every keypress
+  unsigned long skip;//step too big for the history, not recorded
+  bool replaying;//an undo or redo is changing the text, don't record
+};
+
+//where the lines of the mapped file start. every line start is kept unless
+//the file is paged, then only the number of newlines before each
+//KILO_PAGE_BLOCK bytes is, and a line is found by scanning its block
+struct lineIndex {
+  bool paged;
+  int lines;
+  std::vector<size_t> off;//start of every line, plus mapsize at the end
+  std::vector<size_t> nl;//paged: newlines before each block, plus all of them at the end
+  unsigned long gen;//bumped for every mapping, a new one can land at the old address
 };
 
 struct editorConfig {
@@ -72,26 +755,89 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
-  std::vector<erow> row;
+  rowrope row;
+  const char *map;//the opened file mapped read-only, lazy rows point into it
+  size_t mapsize;
+  lineIndex index;
+  size_t budget;//bytes; files over it are paged and clean rows get dropped to stay under
+  int hlgen;//bumped to invalidate the render and hl caches of every row
+  int hl_last_known;//no row past this one has a known hl_open
+  std::vector<int> hl_marks;//lexer state at the start of every KILO_HL_MARK-th row, -1 if unknown
+  int hl_marks_edit;//first row changed since the worker was asked for marks
+  int hl_async;//highlight on the worker thread, drawing rows plain until done
+  int search_async;//search on worker threads, or wait for them before going on
+  int crlf;//every line of the opened file ended in \r\n, saved back the same way
   int dirty;
+  unsigned long edits;//bumped by every change to the text or to where it is kept, never reset
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  editorScreen screen;
+  editorSearch search;
+  editorHistory undo;
+  int framebytes;//bytes the last refresh sent to the terminal
   struct termios orig_termios;
 };
 
 editorConfig E;
 /** filetypes **/
+//every language is a constexpr description: comment markers (nullptr for
+//none), flags and keywords. lexRun is instantiated once per description, so
+//none of it is looked up while lexing
+struct keyword {
+  const char *word;
+  int len;
+  unsigned char hl;//HL_KEYWORD1 or HL_KEYWORD2
+  static constexpr int length(const char *w){ return *w?1+length(w+1):0; }
+  constexpr keyword(const char *w, unsigned char c):word(w),len(length(w)),hl(c){}
+};
+#define K1(w) keyword(w,HL_KEYWORD1)
+#define K2(w) keyword(w,HL_KEYWORD2)
+struct langC {
+  static constexpr const char *scs="//";
+  static constexpr const char *mcs="/*";
+  static constexpr const char *mce="*/";
+  static constexpr int flags=HL_HIGHLIGHT_NUMBERS|HL_HIGHLIGHT_STRINGS;
+  static constexpr keyword words[]={
+    K1("switch"),K1("if"),K1("while"),K1("for"),K1("break"),K1("continue"),K1("return"),
+    K1("else"),K1("struct"),K1("union"),K1("typedef"),K1("static"),K1("enum"),K1("class"),
+    K1("case"),K1("default"),K1("do"),K1("goto"),K1("sizeof"),K1("const"),K1("extern"),
+    K1("inline"),K1("volatile"),K1("register"),K1("template"),K1("typename"),K1("namespace"),
+    K1("using"),K1("public"),K1("private"),K1("protected"),K1("virtual"),K1("new"),
+    K1("delete"),K1("this"),K1("true"),K1("false"),K1("nullptr"),K1("operator"),K1("constexpr"),
+    K2("int"),K2("long"),K2("double"),K2("float"),K2("char"),K2("unsigned"),K2("signed"),
+    K2("void"),K2("short"),K2("bool"),K2("auto"),K2("size_t"),
+  };
+};
+struct langPython {
+  static constexpr const char *scs="#";
+  static constexpr const char *mcs=nullptr;
+  static constexpr const char *mce=nullptr;
+  static constexpr int flags=HL_HIGHLIGHT_NUMBERS|HL_HIGHLIGHT_STRINGS;
+  static constexpr keyword words[]={
+    K1("def"),K1("class"),K1("return"),K1("if"),K1("elif"),K1("else"),K1("for"),K1("while"),
+    K1("in"),K1("not"),K1("and"),K1("or"),K1("is"),K1("import"),K1("from"),K1("as"),
+    K1("with"),K1("try"),K1("except"),K1("finally"),K1("raise"),K1("pass"),K1("break"),
+    K1("continue"),K1("lambda"),K1("yield"),K1("global"),K1("nonlocal"),K1("del"),
+    K1("assert"),K1("async"),K1("await"),K1("True"),K1("False"),K1("None"),
+    K2("int"),K2("str"),K2("float"),K2("list"),K2("dict"),K2("set"),K2("tuple"),
+    K2("bool"),K2("bytes"),K2("self"),
+  };
+};
+#undef K1
+#undef K2
+//C++11 wants a definition of every static member that is used at run time
+constexpr keyword langC::words[];
+constexpr keyword langPython::words[];
+template<class L> void lexRun(const char *text, int len, int to, lexstop *st, unsigned char *hl);
+
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))//store length of HLDB array
-char* C_HL_extensions[]={".c",".h", ".cpp",NULL};
+const char* C_HL_extensions[]={".c",".h", ".cpp",NULL};
+const char* Python_HL_extensions[]={".py",NULL};
 struct editorSyntax HLDB[]={
-  {
-    "c",
-    C_HL_extensions,
-    "//",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-  },
+  {"c",C_HL_extensions,lexRun<langC>},
+  {"python",Python_HL_extensions,lexRun<langPython>},
 };
 //HLDB: Highlight DataBase
 
@@ -99,6 +845,229 @@ struct editorSyntax HLDB[]={
 void editorStatusMessage(const char*fmt,...);
 void editorRefreshScreen();
 char *editorPrompt(const char* prompt, void(*callback)(char*,int));
+int getWindowSize(int *rows, int *cols);
+void editorSaveCollect(bool wait);
+void searchStop();
+size_t lineStart(int line);
+double loopNow();
+int editorRowLex(erow *row, const char *s, int len, int state);
+/*** trace ***/
+//a trace is what the terminal sent, kept as it came in: every read() as a
+//32-bit length and the bytes read. --record writes one from a session,
+//--replay feeds one back with no terminal at all, drawing to a sink that
+//only counts bytes, and reports how long the frames took
+struct editorTrace {
+  int record;//fd the input is recorded to, -1 if none
+  bool replay;
+  std::string keys;//replay: the whole trace
+  size_t at;//replay: where in keys the next bytes are
+  size_t left;//replay: bytes of the current record not handed out yet
+  bool arrived;//replay: the event loop let the next record in
+  int rows, cols;//replay: the virtual screen
+  size_t keys_read, bytes_out;
+  std::vector<double> frames;//replay: seconds each frame took to make
+  double start;
+};
+editorTrace T;
+
+void traceRecord(const char *buf, int len){
+  uint32_t n=len;
+  if(write(T.record,&n,sizeof(n))!=sizeof(n)||write(T.record,buf,len)!=len){
+    close(T.record);//stop recording rather than write a broken trace
+    T.record=-1;
+  }
+}
+int traceLoad(const char *path){
+  FILE *fp=fopen(path,"rb");
+  if(!fp)return -1;
+  char buf[1 << 16];
+  size_t n;
+  while((n=fread(buf,1,sizeof(buf),fp))>0)T.keys.append(buf,n);
+  fclose(fp);
+  T.replay=true;
+  T.at=0;
+  T.left=0;
+  T.arrived=false;
+  return 0;
+}
+bool traceDone(){ return T.left==0&&T.at+sizeof(uint32_t)>T.keys.size(); }
+//copies up to size bytes of the next record to buf, returns how many
+int traceNext(char *buf, int size){
+  if(T.left==0){
+    uint32_t n;
+    memcpy(&n,T.keys.data()+T.at,sizeof(n));
+    T.at+=sizeof(n);
+    T.left=std::min((size_t)n,T.keys.size()-T.at);
+  }
+  int n=std::min(T.left,(size_t)size);
+  memcpy(buf,T.keys.data()+T.at,n);
+  T.at+=n;
+  T.left-=n;
+  return n;
+}
+void traceReport(){
+  if(!T.replay)return;
+  editorSaveCollect(true);
+  double total=0;
+  for(size_t i=0;i<T.frames.size();i++)total+=T.frames[i];
+  std::vector<double> f=T.frames;
+  std::sort(f.begin(),f.end());
+  size_t n=f.size();
+  printf("replay: %zu input bytes, %zu frames, %.3f s wall, %.3f s drawing\n",
+    T.keys_read,n,loopNow()-T.start,total);
+  if(n)printf("frame ms: mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+    total/n*1e3,f[n/2]*1e3,f[n*99/100]*1e3,f[n-1]*1e3);
+  printf("bytes emitted: %zu (%.0f per frame)\n",T.bytes_out,n?(double)T.bytes_out/n:0.0);
+  printf("row memory: %.1f MB in use, %zu slabs of %d KB\n",RP.bytes/1048576.0,RP.slabs.size(),POOL_SLAB>>10);
+}
+
+/*** profiler ***/
+//scoped timers and counters on the hot paths. -DKILO_NO_PROFILE compiles
+//them out, compiled in they cost a load and a branch per scope until Ctrl-P
+//turns profiling on. while it is on the status bar shows frame times and
+//what the last frame cost, and turning it off writes every timed scope to
+//kilo-profile.json as chrome trace events (load it in chrome://tracing)
+#ifndef KILO_NO_PROFILE
+enum profZone {
+  PROF_UPDATE_ROW,
+  PROF_UPDATE_SYNTAX,
+  PROF_DRAW_ROWS,
+  PROF_REFRESH,
+  PROF_FIND,
+  PROF_OPEN,
+  PROF_SAVE,
+  PROF_SAVE_FILE,
+  PROF_ZONES
+};
+const char *profZoneNames[PROF_ZONES]={
+  "editorUpdateRow","editorUpdateSyntax","editorDrawRows","editorRefreshScreen",
+  "editorFindCallBack","editorOpen","editorSave","editorSaveFile"
+};
+enum profCounter {
+  PROF_SYSCALLS,//reads, writes and polls of the terminal, the wake pipe and saves
+  PROF_ALLOCS,//abuf growing
+  PROF_COUNTERS
+};
+#define PROF_EVENTS (1 << 20)//scopes and frames kept for the trace, later ones are dropped
+#define PROF_RECENT 128//frames the overlay percentiles are taken over
+struct profEvent {
+  int zone;
+  bool main;//on the main thread
+  double start, dur;//seconds since profiling was turned on
+};
+struct profFrame {
+  double start, dur;
+  int bytes;
+  unsigned long syscalls, allocs;
+};
+struct editorProfiler {
+  std::atomic<bool> on;
+  double t0;//when it was turned on
+  std::thread::id main;
+  std::mutex lock;//guards events, the save thread ends scopes too
+  std::vector<profEvent> events;
+  std::vector<profFrame> frames;
+  std::atomic<unsigned long> counters[PROF_COUNTERS];
+  unsigned long last[PROF_COUNTERS];//counters when the last frame ended
+};
+editorProfiler P;
+
+void profEnd(int zone, double start){
+  if(!P.on.load(std::memory_order_relaxed))return;
+  profEvent ev={zone,std::this_thread::get_id()==P.main,start-P.t0,loopNow()-start};
+  std::lock_guard<std::mutex> g(P.lock);
+  if(P.events.size()<PROF_EVENTS)P.events.push_back(ev);
+}
+struct profScope {
+  int zone;
+  double start;//0 if profiling was off when the scope began
+  profScope(int z) : zone(z), start(P.on.load(std::memory_order_relaxed)?loopNow():0) {}
+  ~profScope() { if(start>0)profEnd(zone,start); }
+};
+#define PROF_JOIN2(a,b) a##b
+#define PROF_JOIN(a,b) PROF_JOIN2(a,b)
+#define PROF_SCOPE(zone) profScope PROF_JOIN(prof_,__LINE__)(zone)
+#define PROF_COUNT(counter,n) do{ if(P.on.load(std::memory_order_relaxed)) \
+  P.counters[counter].fetch_add(n,std::memory_order_relaxed); }while(0)
+
+//called after each frame with how long it took and what it sent
+void profFrameEnd(double start, double dur, int bytes){
+  if(!P.on.load(std::memory_order_relaxed))return;
+  profFrame f;
+  f.start=start-P.t0;
+  f.dur=dur;
+  f.bytes=bytes;
+  unsigned long c[PROF_COUNTERS];
+  for(int i=0;i<PROF_COUNTERS;i++){
+    c[i]=P.counters[i].load(std::memory_order_relaxed);
+  }
+  f.syscalls=c[PROF_SYSCALLS]-P.last[PROF_SYSCALLS];
+  f.allocs=c[PROF_ALLOCS]-P.last[PROF_ALLOCS];
+  memcpy(P.last,c,sizeof(c));
+  if(P.frames.size()<PROF_EVENTS)P.frames.push_back(f);
+}
+//the status bar overlay: the last frame and percentiles of the recent ones
+int profOverlay(char *buf, size_t size){
+  size_t n=std::min(P.frames.size(),(size_t)PROF_RECENT);
+  if(n==0)return snprintf(buf,size,"profiling");
+  std::vector<double> d;
+  for(size_t i=P.frames.size()-n;i<P.frames.size();i++)d.push_back(P.frames[i].dur*1e3);
+  std::sort(d.begin(),d.end());
+  const profFrame &f=P.frames.back();
+  int len=snprintf(buf,size,"frame %.2fms p50 %.2f p99 %.2f | %dB %lusys %lualloc",
+    f.dur*1e3,d[n/2],d[n*99/100],f.bytes,f.syscalls,f.allocs);
+  return std::min(len,(int)size-1);
+}
+int profDump(const char *path){
+  FILE *fp=fopen(path,"w");
+  if(!fp)return -1;
+  std::lock_guard<std::mutex> g(P.lock);
+  fprintf(fp,"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  const char *sep="";
+  for(size_t i=0;i<P.events.size();i++){
+    const profEvent &ev=P.events[i];
+    fprintf(fp,"%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+      sep,profZoneNames[ev.zone],ev.main?1:2,ev.start*1e6,ev.dur*1e6);
+    sep=",\n";
+  }
+  for(size_t i=0;i<P.frames.size();i++){
+    const profFrame &f=P.frames[i];
+    fprintf(fp,"%s{\"name\": \"frame\", \"ph\": \"C\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, "
+      "\"args\": {\"bytes\": %d, \"syscalls\": %lu, \"allocs\": %lu}}",
+      sep,f.start*1e6,f.bytes,f.syscalls,f.allocs);
+    sep=",\n";
+  }
+  fprintf(fp,"\n]}\n");
+  return fclose(fp)==0?0:-1;
+}
+void profToggle(){
+  if(!P.on.load()){
+    {
+      std::lock_guard<std::mutex> g(P.lock);
+      P.events.clear();
+    }
+    P.frames.clear();
+    for(int i=0;i<PROF_COUNTERS;i++){
+      P.counters[i].store(0);
+      P.last[i]=0;
+    }
+    P.main=std::this_thread::get_id();
+    P.t0=loopNow();
+    P.on.store(true);
+    editorStatusMessage("profiling, Ctrl-P again writes kilo-profile.json");
+    return;
+  }
+  P.on.store(false);
+  if(profDump("kilo-profile.json")==-1)
+    editorStatusMessage("can't write kilo-profile.json: %s",strerror(errno));
+  else
+    editorStatusMessage("kilo-profile.json: %zu scopes, %zu frames",P.events.size(),P.frames.size());
+}
+#else
+#define PROF_SCOPE(zone)
+#define PROF_COUNT(counter,n)
+#endif
+
 /*** terminal ***/
 
 void killswitch(const char *s) {
@@ -110,6 +1079,7 @@ void killswitch(const char *s) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     killswitch("tcsetattr");
 }
@@ -123,37 +1093,223 @@ void enableRawMode() {
   raw.c_oflag &= ~(OPOST);
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  //read never blocks, waiting is done by poll in loopWait
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) killswitch("tcsetattr");
+  //pastes arrive wrapped in ESC[200~ ... ESC[201~ instead of as typed keys
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+//terminal input read but not turned into keys yet. a read takes whatever
+//is there, so a burst of input costs one syscall instead of one per byte
+struct editorInput {
+  char buf[KILO_INPUT_BUF];
+  int pos, len;
+  std::string paste;//text of the last PASTE_KEY
+};
+editorInput IN;
+
+//refills the buffer if it is empty and input comes within ms milliseconds.
+//returns whether there is input in the buffer
+bool inputFill(int ms){
+  if(IN.pos<IN.len)return true;
+  if(T.replay){
+    //a record comes in when the loop waits for input. in the middle of an
+    //escape sequence only the rest of the current record does: a read ended
+    //there, so a lone ESC is a key of its own and times out as it did live
+    if((ms==0&&!T.arrived)||(ms>0&&T.left==0)||traceDone())return false;
+    T.arrived=false;
+    IN.pos=0;
+    IN.len=traceNext(IN.buf,sizeof(IN.buf));
+    T.keys_read+=IN.len;
+    return true;
+  }
+  struct pollfd fd={STDIN_FILENO,POLLIN,0};
+  PROF_COUNT(PROF_SYSCALLS,1);
+  if(poll(&fd,1,ms)<=0)return false;
+  PROF_COUNT(PROF_SYSCALLS,1);
+  int nread=read(STDIN_FILENO,IN.buf,sizeof(IN.buf));
+  if(nread==-1&&errno!=EAGAIN&&errno!=EINTR)killswitch("read");
+  if(nread<=0)return false;
+  IN.pos=0;
+  IN.len=nread;
+  if(T.record!=-1)traceRecord(IN.buf,nread);
+  return true;
+}
+//keys typed faster than frames are drawn are all handled before the next one
+bool inputPending(){ return inputFill(0); }
+//next byte of input, waiting at most ms for it. returns 0 on a timeout
+int inputByte(char *c, int ms=KILO_ESC_WAIT){
+  if(!inputFill(ms))return 0;
+  *c=IN.buf[IN.pos++];
+  return 1;
+}
+//reads a bracketed paste up to its closing ESC[201~ into IN.paste. if the
+//end never comes (a cut off paste, a trace that stops), what came is the paste
+int editorReadPaste(){
+  static const char end[]="\x1b[201~";
+  IN.paste.clear();
+  size_t esc=std::string::npos;//where the last escape went in
+  while(true){
+    char c;
+    if(!inputByte(&c,KILO_PASTE_WAIT))return PASTE_KEY;
+    IN.paste.push_back(c);
+    size_t len=IN.paste.size();
+    if(c=='\x1b')esc=len-1;
+    if(esc!=std::string::npos&&len-esc<6)continue;//might be the end, go byte by byte
+    if(esc!=std::string::npos&&len-esc==6&&!memcmp(IN.paste.data()+esc,end,6)){
+      IN.paste.resize(esc);
+      return PASTE_KEY;
+    }
+    //no end before the next escape, copy up to it in one go
+    char *next=(char*)memchr(IN.buf+IN.pos,'\x1b',IN.len-IN.pos);
+    int n=next?next-(IN.buf+IN.pos):IN.len-IN.pos;
+    IN.paste.append(IN.buf+IN.pos,n);
+    IN.pos+=n;
+  }
+}
+
+/*** event loop ***/
+//the editor sleeps in poll until a key comes, a background thread has
+//something to show, the terminal is resized or a timer runs out. drawing is
+//held back to fps frames a second, keys that come in between are handled
+//first and show up together in the next frame
+struct editorLoop {
+  int wake[2];//pipe background threads write to, see editorWake
+  int sigfd;//signalfd for SIGWINCH, -1 if there is none
+  int fps;//frames a second at most
+  double last_frame;//when the last frame was drawn
+  bool frame_due;//something changed since the last frame
+  double msg_expire;//when the status message goes away, 0 if none is up
+};
+editorLoop L;
+
+double loopNow(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+//wakes the main loop to redraw, from any thread
+void editorWake(){
+  PROF_COUNT(PROF_SYSCALLS,1);
+  if(write(L.wake[1],"",1)==-1){}//a full pipe already has a wakeup in it
+}
+//sets up the wake pipe and the resize signal. called before any thread is
+//started, so they all inherit SIGWINCH blocked and it goes to the signalfd
+void loopInit(){
+  if(pipe(L.wake)==-1)killswitch("pipe");
+  fcntl(L.wake[0],F_SETFL,O_NONBLOCK);
+  fcntl(L.wake[1],F_SETFL,O_NONBLOCK);
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask,SIGWINCH);
+  L.sigfd=-1;
+  if(sigprocmask(SIG_BLOCK,&mask,NULL)==0)
+    L.sigfd=signalfd(-1,&mask,SFD_NONBLOCK|SFD_CLOEXEC);
+  L.fps=KILO_FPS;
+  L.last_frame=0;
+  L.frame_due=true;
+  L.msg_expire=0;
+}
+void loopResize(){
+  struct signalfd_siginfo si;
+  while(read(L.sigfd,&si,sizeof(si))>0);
+  int rows,cols;
+  if(getWindowSize(&rows,&cols)==-1)return;
+  E.screenrows=rows-2;
+  E.screencols=cols;
+  E.screen.valid=false;//the terminal's contents can't be trusted after a resize
+}
+//draws a frame unless the last one was too recent, in which case loopWait
+//comes back for it when its time has come
+void editorFrame(){
+  L.frame_due=true;
+  double now=loopNow();
+  if(L.fps>0&&now-L.last_frame<1.0/L.fps)return;
+  editorRefreshScreen();
+  double dur=loopNow()-now;
+  if(T.replay)T.frames.push_back(dur);
+#ifndef KILO_NO_PROFILE
+  profFrameEnd(now,dur,E.framebytes);
+#endif
+  L.last_frame=now;
+  L.frame_due=false;
+}
+//sleeps until there is something to do. returns 1 once input has come,
+//0 when instead the screen should be redrawn
+int loopWait(){
+  if(T.replay){
+    if(traceDone()){
+      //threads still running would abort the exit
+      searchStop();
+      editorSaveCollect(true);
+      exit(0);//traceReport runs at exit
+    }
+    T.arrived=true;
+    return 1;
+  }
+  while(true){
+    double now=loopNow(),next=-1;
+    if(L.frame_due&&L.fps>0)next=L.last_frame+1.0/L.fps;
+    if(L.msg_expire&&(next<0||L.msg_expire<next))next=L.msg_expire;
+    int ms=-1;
+    if(next>=0)ms=next>now?(int)((next-now)*1000)+1:0;
+
+    struct pollfd fds[3]={{STDIN_FILENO,POLLIN,0},{L.wake[0],POLLIN,0},{L.sigfd,POLLIN,0}};
+    PROF_COUNT(PROF_SYSCALLS,1);
+    int n=poll(fds,L.sigfd==-1?2:3,ms);
+    if(n==-1&&errno!=EINTR)killswitch("poll");
+    if(n<=0){
+      //a timer ran out
+      if(L.msg_expire&&loopNow()>=L.msg_expire)L.msg_expire=0;
+      return 0;
+    }
+    if(fds[0].revents&POLLIN)return 1;
+    if(fds[2].revents&POLLIN){
+      loopResize();
+      return 0;
+    }
+    if(fds[1].revents&POLLIN){
+      char buf[64];
+      while(read(L.wake[0],buf,sizeof(buf))>0)PROF_COUNT(PROF_SYSCALLS,1);
+      return 0;
+    }
+  }
 }
 
 int editorReadKey() {
-  int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) killswitch("read");
+  while (!inputPending()) {
+    if (!loopWait()) return REDRAW_KEY;
   }
+  if (!inputByte(&c)) return REDRAW_KEY;
 
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (!inputByte(&seq[0])) return '\x1b';
+    if (!inputByte(&seq[1])) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        int n=seq[1]-'0';
+        while(true){
+          if (!inputByte(&seq[2])) return '\x1b';
+          if (seq[2] < '0' || seq[2] > '9') break;
+          n=n*10+seq[2]-'0';
+        }
         if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
+          switch (n) {
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200: return editorReadPaste();
           }
         }
       } else {
@@ -186,7 +1342,7 @@ int getCursorPosition(int *rows, int *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (!inputByte(&buf[i], 1000)) break;
     if (buf[i] == 'R') break;
     i++;
   }
@@ -201,6 +1357,12 @@ int getCursorPosition(int *rows, int *cols) {
 int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
 
+  if (T.replay) {
+    *rows = T.rows;
+    *cols = T.cols;
+    return 0;
+  }
+
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
     return getCursorPosition(rows, cols);
@@ -211,35 +1373,142 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 /** syntax highlighting **/
-int is_separator(int c){
-  return isspace(c)||c=='\0'||strchr(",.()+-/*=~<>[];",c)!=NULL;
-}
-void editorUpdateSyntax(erow *row){
-  row->hl=(unsigned char*)realloc(row->hl,row->rsize);//size of hl array= size of render array, so we use rsize for hl.
-  memset(row->hl,HL_NORMAL,row->rsize);//set all characters to HL_NORMAL by default before loop
-  if(E.syntax==NULL)return;
-  char *scs=E.syntax->singleline_comment_start;
-  int scs_len=scs?strlen(scs):0;
-  int prev_sep=1;//consider beggining of line to be a separator
-  int in_string = 0;
-  int i=0;
-  while(i<row->rsize){//changed to while to consume multiple characters for each iteration
-    char c=row->render[i];
-    unsigned char prev_hl=(i>0)?row->hl[i-1]:HL_NORMAL;
-    if(scs_len && !in_string){
-      if(!strncmp(&row->render[i],scs,scs_len)){
-        memset(&row->hl[i],HL_COMMENT,row->rsize-i);
+//character classes, a 256 entry table filled in at compile time
+#define CC_SEP (1 << 0)//ends a word: space, NUL and ,.()+-/*=~<>[];:
+#define CC_DIGIT (1 << 1)
+#define CC_WORD (1 << 2)//can start a keyword
+constexpr bool ccIn(int c, const char *set){ return *set&&(*set==c||ccIn(c,set+1)); }
+constexpr unsigned char ccOf(int c){
+  return (c==0||ccIn(c," \t\n\v\f\r,.()+-/*=~<>[];:")?CC_SEP:0)|
+    (c>='0'&&c<='9'?CC_DIGIT:0)|
+    ((c>='a'&&c<='z')||(c>='A'&&c<='Z')||c=='_'?CC_WORD:0);
+}
+template<int...> struct ints {};
+template<int N, int... I> struct upto : upto<N-1,N-1,I...> {};
+template<int... I> struct upto<0,I...> { typedef ints<I...> type; };
+template<class> struct ccTable;
+template<int... I> struct ccTable<ints<I...> > {
+  static constexpr unsigned char c[sizeof...(I)]={ccOf(I)...};
+};
+template<int... I> constexpr unsigned char ccTable<ints<I...> >::c[sizeof...(I)];
+typedef ccTable<upto<256>::type> CC;
+
+//keywords are found through a perfect hash: the seed is searched for at
+//compile time so that no two keywords of a language share a slot, and a
+//word then costs one hash and at most one compare
+#define KW_SLOTS 512
+constexpr unsigned kwHash(const char *s, int len, unsigned seed){
+  return ((unsigned char)s[0]*seed+(unsigned char)s[len-1]*31u+
+    (unsigned char)s[len>>1]*7u+(unsigned)len*131u)&(KW_SLOTS-1);
+}
+template<class L> struct kwSet {
+  static constexpr int n=sizeof(L::words)/sizeof(L::words[0]);
+  static constexpr unsigned h(int k, unsigned seed){ return kwHash(L::words[k].word,L::words[k].len,seed); }
+  static constexpr bool apart(int i, int j, unsigned seed){ return j>=n||(h(i,seed)!=h(j,seed)&&apart(i,j+1,seed)); }
+  static constexpr bool perfect(unsigned seed, int i=0){ return i>=n||(apart(i,i+1,seed)&&perfect(seed,i+1)); }
+  static constexpr unsigned search(unsigned seed){ return seed>300||perfect(seed)?seed:search(seed+1); }
+  static constexpr int longer(int a, int b){ return a>b?a:b; }
+  static constexpr int longest(int k=0){ return k>=n?0:longer(L::words[k].len,longest(k+1)); }
+  static constexpr unsigned seed=search(1);
+  static constexpr int maxlen=longest();
+  static_assert(n<256&&seed<=300,"no perfect hash for the keywords, raise KW_SLOTS");
+  static_assert(maxlen<LEX_LOOKAHEAD,"keyword longer than the lexer may look ahead");
+};
+template<class L, class> struct kwSlots;
+template<class L, int... I> struct kwSlots<L,ints<I...> > {
+  static constexpr unsigned char at(unsigned slot, int k=0){
+    return k>=kwSet<L>::n?0:kwSet<L>::h(k,kwSet<L>::seed)==slot?k+1:at(slot,k+1);
+  }
+  static constexpr unsigned char slot[sizeof...(I)]={at(I)...};//keyword index+1, 0 for none
+};
+template<class L, int... I> constexpr unsigned char kwSlots<L,ints<I...> >::slot[sizeof...(I)];
+//length of the keyword text starts with, or 0. *hl gets its class
+template<class L> int kwFind(const char *text, int avail, unsigned char *hl){
+  typedef kwSet<L> K;
+  int len=0;
+  while(len<avail&&len<=K::maxlen&&!(CC::c[(unsigned char)text[len]]&CC_SEP))len++;
+  if(len>K::maxlen)return 0;
+  int k=kwSlots<L,upto<KW_SLOTS>::type>::slot[kwHash(text,len,K::seed)];
+  if(!k)return 0;
+  const keyword &w=L::words[k-1];
+  if(w.len!=len||memcmp(text,w.word,len))return 0;
+  *hl=w.hl;
+  return len;
+}
+constexpr int litLen(const char *s){ return s?keyword::length(s):0; }
+constexpr const char *lit(const char *s){ return s?s:""; }
+
+//runs the highlighter for syn over text[st->at,to) and leaves st where it
+//stopped, so a long row can be lexed a piece at a time. bytes up to len may
+//be looked at to finish a token, and st->at may end up a little past to.
+//hl, when not NULL, receives a class for every byte from st->at on
+void editorSyntaxLexRun(struct editorSyntax *syn, const char *text, int len, int to, lexstop *st, unsigned char *hl){
+  if(syn){
+    syn->lex(text,len,to,st,hl);
+    return;
+  }
+  if(hl&&st->at<to)memset(&hl[st->at],HL_NORMAL,to-st->at);
+  if(st->at<to)st->at=to;
+}
+//the lexer of language L. its comment markers and flags are constants here,
+//so the checks for what L lacks compile away
+template<class L> void lexRun(const char *text, int len, int to, lexstop *st, unsigned char *hl){
+  constexpr int scs_len=litLen(L::scs);
+  constexpr int mcs_len=litLen(L::mcs);
+  constexpr int mce_len=litLen(L::mce);
+  static_assert(scs_len<LEX_LOOKAHEAD&&mcs_len<LEX_LOOKAHEAD&&mce_len<LEX_LOOKAHEAD,"comment marker too long");
+  int i=st->at;
+  if(hl&&i<to)memset(&hl[i],HL_NORMAL,to-i);//set all characters to HL_NORMAL by default before loop
+  int prev_sep=!(st->flags&LEX_AFTER_WORD);//consider beggining of line to be a separator
+  int prev_number=(st->flags&LEX_AFTER_NUMBER)!=0;
+  int in_comment=(st->state==HLS_COMMENT);
+  int in_string=in_comment?0:st->state;
+  int flags=st->flags&(LEX_LINE_COMMENT|LEX_CONTINUED);
+  if(flags&LEX_LINE_COMMENT){
+    if(hl&&i<to)memset(&hl[i],HL_COMMENT,to-i);
+    if(i<to)i=to;
+  }
+  while(i<to){//changed to while to consume multiple characters for each iteration
+    char c=text[i];
+    unsigned char cc=CC::c[(unsigned char)c];
+    if(scs_len && !in_string && !in_comment){
+      if(i+scs_len<=len&&!memcmp(&text[i],lit(L::scs),scs_len)){
+        if(hl)memset(&hl[i],HL_COMMENT,to-i);
+        flags|=LEX_LINE_COMMENT;
+        i=to;
         break;
       }
     }
-    if(E.syntax->flags & HL_HIGHLIGHT_STRINGS){
+    int after_number=prev_number;
+    prev_number=0;
+    if(mcs_len && mce_len && !in_string){
+      if(in_comment){
+        if(hl)hl[i]=HL_MLCOMMENT;
+        if(i+mce_len<=len&&!memcmp(&text[i],lit(L::mce),mce_len)){
+          if(hl)memset(&hl[i],HL_MLCOMMENT,mce_len);
+          i+=mce_len;
+          in_comment=0;
+          prev_sep=1;
+        }else{
+          i++;
+        }
+        continue;
+      }else if(i+mcs_len<=len&&!memcmp(&text[i],lit(L::mcs),mcs_len)){
+        if(hl)memset(&hl[i],HL_MLCOMMENT,mcs_len);
+        i+=mcs_len;
+        in_comment=1;
+        continue;
+      }
+    }
+    if(L::flags & HL_HIGHLIGHT_STRINGS){
       if(in_string){
-        row->hl[i]=HL_STRING;
-        if(c=='\\'&& i+1<row->rsize){
-          row->hl[i+1]=HL_STRING;
+        if(hl)hl[i]=HL_STRING;
+        if(c=='\\'&& i+1<len){
+          if(hl)hl[i+1]=HL_STRING;
           i+=2;
           continue;
         }
+        if(c=='\\')flags|=LEX_CONTINUED;
         if(c==in_string) in_string=0;
         i++;
         prev_sep=1;
@@ -247,35 +1516,179 @@ void editorUpdateSyntax(erow *row){
       }else{
         if(c=='"'|| c=='\''){//highlight double and single quote
           in_string=c;//stored here to know which one closes the string
-          row->hl[i]=HL_STRING;
+          if(hl)hl[i]=HL_STRING;
           i++;
           continue;
         }
       }
     }
-    if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
-    if((isdigit(c)&&(prev_sep||prev_hl==HL_NUMBER))||(c=='.'&&prev_hl==HL_NUMBER)){
-      row->hl[i]=HL_NUMBER;
+    if(L::flags & HL_HIGHLIGHT_NUMBERS){
+    if(((cc&CC_DIGIT)&&(prev_sep||after_number))||(c=='.'&&after_number)){
+      if(hl)hl[i]=HL_NUMBER;
       i++;
       prev_sep=0;
+      prev_number=1;
       continue;
     }
     }
-    prev_sep=is_separator(c);
+    if(prev_sep&&(cc&CC_WORD)){
+      unsigned char kw;
+      int n=kwFind<L>(&text[i],len-i,&kw);
+      if(n){
+        if(hl)memset(&hl[i],kw,n);
+        i+=n;
+        prev_sep=0;
+        continue;
+      }
+    }
+    prev_sep=(cc&CC_SEP)!=0;
     i++;
   }
+  st->at=i;
+  st->state=in_comment?HLS_COMMENT:in_string;
+  st->flags=flags|(prev_sep?0:LEX_AFTER_WORD)|(prev_number?LEX_AFTER_NUMBER:0);
+}
+//state a row ends in, given where the lexer stopped at its end
+int editorLexEndState(const lexstop &st){
+  if(st.state==HLS_COMMENT)return HLS_COMMENT;
+  return (st.flags&LEX_CONTINUED)?st.state:HLS_NORMAL;
+}
+//runs the highlighter for syn over one line starting in lexer state state and returns
+//the state at its end. hl, when not NULL, receives a class for every byte
+int editorSyntaxLex(struct editorSyntax *syn, const char *text, int len, int state, unsigned char *hl){
+  lexstop st={0,state,0};
+  editorSyntaxLexRun(syn,text,len,len,&st,hl);
+  return editorLexEndState(st);
+}
+//lexer state at the start of row k*KILO_HL_MARK, -1 if unknown
+int hlMark(int k){
+  if(k==0)return HLS_NORMAL;
+  return k<(int)E.hl_marks.size()?E.hl_marks[k]:-1;
+}
+void hlMarkSet(int k, int state){
+  if(k>=(int)E.hl_marks.size())E.hl_marks.resize(k+1,-1);
+  E.hl_marks[k]=state;
+  if(k*KILO_HL_MARK-1>E.hl_last_known)E.hl_last_known=k*KILO_HL_MARK-1;
+}
+//called when row at changes: marks the worker finds after it are stale
+void hlMarksEdited(int at){
+  if(at<E.hl_marks_edit)E.hl_marks_edit=at;
+}
+//forgets the marks after row at, the rows before them changed
+void hlMarksDrop(int at){
+  size_t keep=at/KILO_HL_MARK+1;
+  if(E.hl_marks.size()>keep)E.hl_marks.resize(keep);
+}
+void editorSetRowState(int at, erow *row, int state){
+  row->hl_open=state;
+  row->stategen=E.hlgen;
+  if(at>E.hl_last_known)E.hl_last_known=at;
+  if((at+1)%KILO_HL_MARK==0)hlMarkSet((at+1)/KILO_HL_MARK,state);
+}
+//text a row is drawn from
+const char *editorRowRender(const erow *row){
+  return row->render?row->render:row->chars.data();
+}
+hlspan *editorRowSpans(erow *row){
+  return row->nhl>HL_INLINE?row->hl:row->hlin;
+}
+void hlFree(erow *row){
+  if(row->nhl>HL_INLINE)poolFree(row->hl,row->nhl*sizeof(hlspan));
+  row->nhl=0;
+}
+//replaces the spans of row with the runs in hl, a class for every one of len bytes
+void hlPack(erow *row, const unsigned char *hl, int len){
+  int n=0;
+  for(int i=0,j;i<len;i=j){
+    for(j=i+1;j<len&&hl[j]==hl[i];j++);
+    if(hl[i]!=HL_NORMAL)n+=(j-i+65534)/65535;
+  }
+  hlFree(row);
+  row->nhl=n;
+  hlspan *sp=row->hlin;
+  if(n>HL_INLINE){
+    sp=row->hl=(hlspan*)poolAlloc(n*sizeof(hlspan));
+  }
+  for(int i=0,j;i<len;i=j){
+    for(j=i+1;j<len&&hl[j]==hl[i]&&j-i<65535;j++);
+    if(hl[i]!=HL_NORMAL)*sp++={i,(unsigned short)(j-i),hl[i]};
+  }
+}
+void editorUpdateSyntax(erow *row, int start){
+  PROF_SCOPE(PROF_UPDATE_SYNTAX);
+  static thread_local std::vector<unsigned char> hl;
+  if(hl.size()<(size_t)row->rsize+1)hl.resize(row->rsize+1);
+  row->hl_start=start;
+  row->hl_open=editorSyntaxLex(E.syntax,editorRowRender(row),row->rsize,start,hl.data());
+  hlPack(row,hl.data(),row->rsize);
+  row->stategen=E.hlgen;
+}
+//lexer state at the start of row at. walks back to the closest row whose end
+//state is known, no further than the mark before at, and lexes forward from
+//there over the raw text. -1 when neither is known: lexing from further up
+//is left to the highlight worker
+int editorSyntaxStartState(int at){
+  if(at<=0||E.syntax==NULL)return HLS_NORMAL;
+  E.row[at-1];//load the row above so the answer stays cached for next time
+  int base=at/KILO_HL_MARK*KILO_HL_MARK;
+  int from=base,state=hlMark(at/KILO_HL_MARK);
+  E.row.forEachLineBack(base,at,[&](int filerow,const char*,int,erow *row){
+    if(!row||row->stategen!=E.hlgen)return true;
+    from=filerow+1;
+    state=row->hl_open;
+    return false;
+  });
+  if(state<0)return -1;
+  E.row.forEachLine(from,at,[&](int filerow,const char *s,int len,erow *row){
+    state=editorRowLex(row,s,len,state);
+    if(row)editorSetRowState(filerow,row,state);
+    return true;
+  });
+  return state;
+}
+//called after rows at..last were edited: re-lexes them, then goes on until a
+//row ends in the state it had before, since nothing after it can have changed.
+//it stops at the first mark after the edited rows: what comes after is
+//forgotten and found again by the highlight worker once it is looked at
+void editorSyntaxPropagate(int at, int last){
+  if(E.syntax==NULL||at>=E.numrows)return;
+  int state=editorSyntaxStartState(at);
+  int stop=(last/KILO_HL_MARK+1)*KILO_HL_MARK;
+  if(state<0)stop=at;//nothing known above, so nothing below can be trusted
+  E.row.forEachLine(at,E.numrows,[&](int filerow,const char *s,int len,erow *row){
+    if(filerow>E.hl_last_known)return false;//nothing further down depends on us
+    if(filerow>=stop){
+      hlMarksDrop(stop);
+      E.hlgen++;//row states are only known again from the marks
+      return false;
+    }
+    state=editorRowLex(row,s,len,state);
+    if(!row){//a line still in the map keeps no state, but a mark after it must
+      if((filerow+1)%KILO_HL_MARK==0)hlMarkSet((filerow+1)/KILO_HL_MARK,state);
+      return true;
+    }
+    bool same=row->stategen==E.hlgen&&row->hl_open==state;
+    editorSetRowState(filerow,row,state);
+    return !same||filerow<last;
+  });
 }
 int editorSyntaxToColor(int hl){
   switch(hl){
-    case HL_COMMENT: return 36;//36: cyan
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;//36: cyan
     case HL_STRING: return 35;//35: magenta
     case HL_NUMBER: return 31;//31: foreground red
+    case HL_KEYWORD1: return 33;//33: yellow
+    case HL_KEYWORD2: return 32;//32: green
     case HL_MATCH: return 34;//34: blue
     default: return 37;//37: foreground white
   }
 }
 void editorSelectSyntaxHighlight(){
   E.syntax=NULL;
+  E.hlgen++;//rows pick up the new highlighting when they are next drawn
+  E.hl_marks.clear();
+  E.hl_marks_edit=-1;//and marks the worker is still finding are for the old syntax
   if(E.filename==NULL) return;
   char *ext=strrchr(E.filename, '.');
   for(unsigned int i =0;i<HLDB_ENTRIES;i++){
@@ -286,177 +1699,2077 @@ void editorSelectSyntaxHighlight(){
       if((is_ext&&ext&&!strcmp(ext,s->filematch[j]))||
       (!is_ext&&strstr(E.filename,s->filematch[j]))){
         E.syntax=s;
-        int filerow;
-        for(filerow=0;filerow< E.numrows;filerow++){
-          editorUpdateSyntax(&E.row[filerow]);
-        }
         return;
       }
       j++;
     }
   }
 }
-/*** row operations ***/
-int editorRowRxToCx(erow *row, int rx){
-  int cur_rx=0;
-  int cx;
-  for(cx=0;cx<row->size;cx++){
-    if(row->chars[cx]=='\t')
-    cur_rx+=(KILO_TAB_STOP-1)-(cur_rx%KILO_TAB_STOP);
-  cur_rx++;
-  if(cur_rx>rx)return cx;
-
+/*** row operations ***/
+/** long rows **/
+//a long row is cut in chunks of about KILO_COL_CHUNK bytes kept in a segment
+//tree, so mapping columns costs O(log n) plus one chunk, and an edit only
+//rescans its chunk. tabs make a chunk's width depend on the column it starts
+//at, but only up to its first tab: starting at x it ends at x+head when it
+//has no tab, and at the tab stop after x+head plus tail when it has one.
+//two such spans in a row make one again, which is what the tree adds up.
+//every chunk also keeps the lexer state it starts in, so only changed
+//chunks are lexed again, and only a slice around the screen is rendered
+struct colspan {
+  int chars;
+  int head, tail;
+  bool tab;
+};
+struct rowcols {
+  int n;//chunks
+  int leaves;//n rounded up to a power of two
+  std::vector<colspan> tree;//tree[1] is the whole row, tree[leaves+k] chunk k
+  std::vector<lexstop> lexin;//where lexing chunk k last started, at counted from its start
+  std::vector<lexstop> lexout;//where it stopped, at counted from the chunk's end
+  std::vector<char> lexok;//lexout still follows from lexin and the chunk's text
+  int lexgen;//E.hlgen the lexer states were made for
+  int rx0;//render column render[0] is at
+  int coloff, screencols;//the view the render slice was cut for
+};
+int colStop(int rx){ return rx+KILO_TAB_STOP-rx%KILO_TAB_STOP; }
+int colApply(const colspan &c, int rx){
+  return c.tab?colStop(rx+c.head)+c.tail:rx+c.head;
+}
+//a followed by b
+colspan colJoin(const colspan &a, const colspan &b){
+  colspan c;
+  c.chars=a.chars+b.chars;
+  c.tab=a.tab||b.tab;
+  if(!a.tab){
+    c.head=a.head+b.head;
+    c.tail=b.tail;
+  }else{
+    c.head=a.head;
+    c.tail=b.tab?colStop(a.tail+b.head)+b.tail:a.tail+b.head;
+  }
+  return c;
+}
+colspan colScan(const char *s, int len){
+  colspan c={len,0,0,false};
+  for(int i=0;i<len;i++){
+    if(s[i]=='\t'){
+      c.tail=c.tab?colStop(c.tail):0;
+      c.tab=true;
+    }else if(c.tab){
+      c.tail++;
+    }else{
+      c.head++;
+    }
+  }
+  return c;
+}
+void colsFree(erow *row){
+  if(row->cols)colsLive--;
+  delete row->cols;
+  row->cols=NULL;
+}
+//drops render, hl and the column index, all rebuilt when the row is next drawn
+void editorRowFreeCaches(erow *row){
+  if(row->render)poolFree(row->render,row->rsize+1);
+  row->render=NULL;
+  hlFree(row);
+  colsFree(row);
+  row->hlgen=0;
+}
+void colsBuild(erow *row){
+  rowcols *c=new rowcols();
+  c->n=(row->size+KILO_COL_CHUNK-1)/KILO_COL_CHUNK;
+  for(c->leaves=1;c->leaves<c->n;c->leaves*=2);
+  c->tree.assign(2*c->leaves,colspan());
+  for(int k=0;k<c->n;k++){
+    int from=k*KILO_COL_CHUNK;
+    c->tree[c->leaves+k]=colScan(row->chars.data()+from,std::min(KILO_COL_CHUNK,row->size-from));
+  }
+  for(int t=c->leaves-1;t>0;t--)c->tree[t]=colJoin(c->tree[2*t],c->tree[2*t+1]);
+  c->lexin.resize(c->n);
+  c->lexout.resize(c->n);
+  c->lexok.assign(c->n,0);
+  c->lexgen=E.hlgen;
+  c->rx0=-1;
+  row->cols=c;
+  colsLive++;
+}
+//the column index of row, NULL for a row that is not long
+rowcols *editorRowCols(erow *row){
+  if(!row->cols&&row->size>=KILO_LONG_ROW){
+    colsBuild(row);
+  }else if(row->cols&&row->size<KILO_LONG_ROW/2){
+    colsFree(row);
+    row->hlgen=0;//render was only a slice
+  }
+  return row->cols;
+}
+//chunk holding byte cx, the last one for the end of the row
+int colsChunk(rowcols *c, int cx, int *start){
+  int t=1;
+  *start=0;
+  while(t<c->leaves){
+    if(cx<*start+c->tree[2*t].chars){
+      t=2*t;
+    }else{
+      *start+=c->tree[2*t].chars;
+      t=2*t+1;
+    }
+  }
+  int k=t-c->leaves;
+  if(k>=c->n){
+    k=c->n-1;
+    *start=c->tree[1].chars-c->tree[c->leaves+k].chars;
+  }
+  return k;
+}
+//keeps the index of row in step with its text, in which removed bytes at
+//col were just replaced by added ones. a big change drops the index, it
+//is rebuilt in one pass when next needed
+void colsEdit(erow *row, int col, int removed, int added){
+  rowcols *c=row->cols;
+  if(removed+added>KILO_COL_CHUNK){
+    colsFree(row);
+    return;
+  }
+  int start;
+  int first=colsChunk(c,col,&start),last=first;
+  colspan *leaf=&c->tree[c->leaves];
+  int gone=std::min(removed,start+leaf[first].chars-col);
+  leaf[first].chars+=added-gone;
+  for(removed-=gone;removed>0;removed-=gone){//the removed bytes ran on into the next chunks
+    last++;
+    gone=std::min(removed,leaf[last].chars);
+    leaf[last].chars-=gone;
+  }
+  //the lexer may have looked a few bytes past the end of the chunk before
+  if(first>0&&col-start<LEX_LOOKAHEAD)c->lexok[first-1]=0;
+  for(int k=first;k<=last;k++){
+    if(leaf[k].chars>2*KILO_COL_CHUNK){
+      colsFree(row);
+      return;
+    }
+    leaf[k]=colScan(row->chars.data()+start,leaf[k].chars);
+    start+=leaf[k].chars;
+    c->lexok[k]=0;
+    for(int t=(c->leaves+k)/2;t>0;t/=2)c->tree[t]=colJoin(c->tree[2*t],c->tree[2*t+1]);
+  }
+  c->rx0=-1;
+}
+int colsCxToRx(rowcols *c, erow *row, int cx){
+  int t=1,rx=0,start=0;
+  while(t<c->leaves){
+    if(cx<start+c->tree[2*t].chars){
+      t=2*t;
+    }else{
+      rx=colApply(c->tree[2*t],rx);
+      start+=c->tree[2*t].chars;
+      t=2*t+1;
+    }
+  }
+  for(int i=start;i<cx;i++)rx=row->chars[i]=='\t'?colStop(rx):rx+1;
+  return rx;
+}
+int colsRxToCx(rowcols *c, erow *row, int rx){
+  int t=1,x=0,cx=0;
+  while(t<c->leaves){
+    int nx=colApply(c->tree[2*t],x);
+    if(nx>rx){
+      t=2*t;
+    }else{
+      x=nx;
+      cx+=c->tree[2*t].chars;
+      t=2*t+1;
+    }
+  }
+  for(;cx<row->size;cx++){
+    x=row->chars[cx]=='\t'?colStop(x):x+1;
+    if(x>rx)return cx;
+  }
+  return cx;
+}
+//lexer stop at the start of chunk j of row, which starts in lexer state
+//state. a chunk is only lexed again when its text changed or it now starts
+//in another state, so typing in a long row lexes about one chunk
+lexstop colsLexTo(rowcols *c, erow *row, int j, int state){
+  if(c->lexgen!=E.hlgen){
+    std::fill(c->lexok.begin(),c->lexok.end(),0);
+    c->lexgen=E.hlgen;
+  }
+  lexstop st={0,state,0};
+  int from=0;//where chunk k starts
+  for(int k=0;k<j;k++){
+    int chars=c->tree[c->leaves+k].chars;
+    lexstop &in=c->lexin[k];
+    if(!c->lexok[k]||in.at!=st.at||in.state!=st.state||in.flags!=st.flags){
+      in=st;
+      lexstop run=st;
+      run.at+=from;
+      editorSyntaxLexRun(E.syntax,row->chars.data(),row->size,from+chars,&run,NULL);
+      run.at-=from+chars;
+      c->lexout[k]=run;
+      c->lexok[k]=1;
+    }
+    st=c->lexout[k];
+    from+=chars;
+  }
+  return st;
+}
+//render and hl of a long row for the columns on screen only, starting from
+//the last place before them the lexer stopped at
+void colsRenderSlice(rowcols *c, erow *row, int start){
+  int want=colsRxToCx(c,row,E.coloff);
+  int from;
+  int k=colsChunk(c,want,&from);
+  lexstop st=colsLexTo(c,row,k,start);
+  while(k>0&&from+st.at>want){
+    k--;
+    from-=c->tree[c->leaves+k].chars;
+    st=colsLexTo(c,row,k,start);
+  }
+  int cx0=std::min(from+st.at,row->size);
+  //a little past the screen, so the tokens at its edge are lexed whole
+  int cx1=std::min(row->size,colsRxToCx(c,row,E.coloff+E.screencols)+LEX_LOOKAHEAD);
+  int rx=c->rx0=colsCxToRx(c,row,cx0);
+  std::string render;
+  for(int i=cx0;i<cx1;i++){
+    if(row->chars[i]!='\t'){
+      render+=row->chars[i];
+      rx++;
+      continue;
+    }
+    int stop=colStop(rx);
+    render.append(stop-rx,' ');
+    rx=stop;
+  }
+  if(row->render)poolFree(row->render,row->rsize+1);
+  row->rsize=render.size();
+  row->render=(char*)poolAlloc(row->rsize+1);
+  memcpy(row->render,render.c_str(),row->rsize+1);
+  std::vector<unsigned char> hl(row->rsize+1);
+  st.at=0;
+  editorSyntaxLexRun(E.syntax,row->render,row->rsize,row->rsize,&st,hl.data());
+  hlPack(row,hl.data(),row->rsize);
+  row->hlgen=E.hlgen;
+  row->hl_start=start;
+  row->hl_job=0;
+  c->coloff=E.coloff;
+  c->screencols=E.screencols;
+}
+//lexer state at the end of row, which starts in lexer state state. row is
+//NULL for a line only in the mapped file, s and len are its text
+int editorRowLex(erow *row, const char *s, int len, int state){
+  rowcols *c=row?editorRowCols(row):NULL;
+  if(c)return editorLexEndState(colsLexTo(c,row,c->n,state));
+  return editorSyntaxLex(E.syntax,s,len,state,NULL);
+}
+//render column of byte cx and back, O(log n) on long rows
+int editorRowRxToCx(erow *row, int rx){
+  rowcols *c=editorRowCols(row);
+  if(c)return colsRxToCx(c,row,rx);
+  int cur_rx=0;
+  int cx;
+  for(cx=0;cx<row->size;cx++){
+    if(row->chars[cx]=='\t')
+    cur_rx+=(KILO_TAB_STOP-1)-(cur_rx%KILO_TAB_STOP);
+  cur_rx++;
+  if(cur_rx>rx)return cx;
+
+  }
+  return cx;
+}
+int editorRowCxtoRx(erow*row,int cx){
+  rowcols *c=editorRowCols(row);
+  if(c)return colsCxToRx(c,row,cx);
+  int rx=0;
+  for(int i=0;i<cx;i++){
+    if(row->chars[i]=='\t')
+    //if its a tab, we use rx%KILO_TAB_STOP
+    //to find how many columns we are to the right of the last tab stop
+    rx+=(KILO_TAB_STOP-1)-(rx%KILO_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+//rebuilds the tab-expanded render, only kept for rows with tabs. hl no
+//longer matches it afterwards
+void editorUpdateRender(erow *row) {
+  int tabs = 0;
+  int j;
+
+  for (j = 0; j < row->size; j++)
+    if (row->chars[j] == '\t') tabs++;
+
+  row->hlgen = E.hlgen;
+  row->hl_start = -1;
+  row->hl_job = 0;
+  if (row->render) poolFree(row->render, row->rsize + 1);
+  row->render = NULL;
+  row->rsize = row->size;
+  if (tabs == 0) return;
+  row->rsize = row->size + tabs * (KILO_TAB_STOP - 1);
+  row->render = (char *)poolAlloc(row->rsize + 1);
+  int idx = 0;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = row->chars[j];
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+}
+void editorUpdateRow(erow *row, int start) {
+  PROF_SCOPE(PROF_UPDATE_ROW);
+  editorUpdateRender(row);
+  editorUpdateSyntax(row,start);
+}
+//render and hl are caches, rebuilt here only for rows that are looked at.
+//start is the lexer state the row begins in
+erow *editorRenderRow(erow *row, int start){
+  rowcols *c=editorRowCols(row);
+  if(c){
+    if(row->hlgen!=E.hlgen||row->hl_start!=start||c->rx0<0||
+       c->coloff!=E.coloff||c->screencols!=E.screencols)colsRenderSlice(c,row,start);
+    return row;
+  }
+  if(row->hlgen!=E.hlgen)editorUpdateRow(row,start);
+  else if(row->hl_start!=start)editorUpdateSyntax(row,start);
+  return row;
+}
+/** undo log **/
+size_t undoBytes(){
+  editorHistory &U=E.undo;
+  return (U.ops.size()-U.first)*sizeof(undoop)+U.text.size();
+}
+//forgets the whole history, for a newly opened file
+void undoReset(){
+  editorHistory &U=E.undo;
+  U.ops.clear();
+  U.first=U.done=0;
+  U.text.clear();
+  U.base=0;
+  U.replaying=false;
+}
+//drops the oldest steps until the history fits in max again. if the step
+//being recorded is too big on its own, the history is given up
+void undoTrim(){
+  editorHistory &U=E.undo;
+  while(undoBytes()>U.max&&U.first<U.done){
+    unsigned long step=U.ops[U.first].step;
+    if(step==U.step){
+      undoReset();
+      U.skip=step;
+      editorStatusMessage("change too big to undo, history cleared");
+      return;
+    }
+    while(U.first<U.done&&U.ops[U.first].step==step)U.first++;
+  }
+  //give the dropped space back once it is most of the log
+  if(U.first>U.ops.size()/2&&U.first>1024){
+    size_t cut=U.first<U.ops.size()?U.ops[U.first].off-U.base:U.text.size();
+    U.text.erase(0,cut);
+    U.base+=cut;
+    U.ops.erase(U.ops.begin(),U.ops.begin()+U.first);
+    U.done-=U.first;
+    U.first=0;
+  }
+}
+//the op a change extends, if it can be folded into it: same kind, made by
+//this keypress or the one right before, and nothing logged after it
+undoop *undoLast(int kind, int row){
+  editorHistory &U=E.undo;
+  if(U.done==U.first||U.done!=U.ops.size())return NULL;
+  undoop *op=&U.ops[U.done-1];
+  if(op->kind!=kind||op->row!=row||op->step+1<U.step)return NULL;
+  if(op->off-U.base+op->len!=U.text.size())return NULL;
+  return op;
+}
+void undoRecord(int kind, int row, int col, const char *s, size_t len){
+  editorHistory &U=E.undo;
+  if(U.replaying||U.skip==U.step)return;
+  //a new change drops what could be redone
+  if(U.done<U.ops.size()){
+    U.text.resize(U.ops[U.done].off-U.base);
+    U.ops.resize(U.done);
+  }
+  undoop *op=NULL;
+  if(kind==UNDO_INSERT){
+    op=undoLast(kind,row);
+    if(op&&op->col+(int)op->len==col){
+      U.text.append(s,len);//typing on
+    }else{
+      op=NULL;
+    }
+  }else if(kind==UNDO_DELETE&&(op=undoLast(kind,row))){
+    if(col+(int)len==op->col&&(op->back||op->len==1)){
+      for(size_t i=len;i>0;i--)U.text.push_back(s[i-1]);//backspacing
+      op->back=true;
+      op->col=col;
+    }else if(col==op->col&&!op->back){
+      U.text.append(s,len);//deleting forward
+    }else{
+      op=NULL;
+    }
+  }
+  if(op){
+    if(op->step!=U.step){
+      //the run moves to this keypress, what is left of its old one ends
+      //where the run began
+      if(U.done-1>U.first&&U.ops[U.done-2].step==op->step){
+        U.ops[U.done-2].ax=op->bx;
+        U.ops[U.done-2].ay=op->by;
+      }
+      op->step=U.step;
+    }
+    op->len+=len;
+  }else{
+    undoop n;
+    n.kind=kind;
+    n.back=false;
+    n.row=row;
+    n.col=col;
+    n.step=U.step;
+    n.off=U.base+U.text.size();
+    n.len=len;
+    n.bx=E.cx;
+    n.by=E.cy;
+    U.text.append(s,len);
+    U.ops.push_back(n);
+    U.done++;
+  }
+  undoTrim();
+}
+//called after every keypress, remembers where the cursor ended up
+void undoSeal(){
+  editorHistory &U=E.undo;
+  if(U.done>U.first&&U.ops[U.done-1].step==U.step){
+    U.ops[U.done-1].ax=E.cx;
+    U.ops[U.done-1].ay=E.cy;
+  }
+  U.step++;
+}
+
+void editorInsertRow(int at,const char *s, size_t len) {
+  if(at<0 || at>E.numrows) return;
+  undoRecord(UNDO_ROW_INSERT,at,0,s,len);
+  erow &row=E.row.insert(at);
+  row.size = len;
+  row.chars.assign(s, len);
+  row.hlgen=0;
+  if(at<=E.hl_last_known)E.hl_last_known++;
+  hlMarksDrop(at);
+  hlMarksEdited(at);
+  E.numrows++;
+  E.dirty++;
+  E.edits++;
+}
+//inserts lines[from..] as rows starting at row at, taking their text
+void editorInsertRows(int at, std::vector<std::string> &lines, size_t from){
+  if(at<0 || at>E.numrows || from>=lines.size()) return;
+  std::vector<rownode*> nodes;
+  nodes.reserve(lines.size()-from);
+  for(size_t i=from;i<lines.size();i++){
+    undoRecord(UNDO_ROW_INSERT,at+(int)nodes.size(),0,lines[i].data(),lines[i].size());
+    rownode *n=ropeNewNode(-1,1);
+    n->row.chars.assign(lines[i].data(),lines[i].size());
+    n->row.size=n->row.chars.size();
+    nodes.push_back(n);
+  }
+  E.row.insertNodes(at,nodes);
+  int n=nodes.size();
+  if(at<=E.hl_last_known)E.hl_last_known+=n;
+  hlMarksDrop(at);
+  hlMarksEdited(at);
+  E.numrows+=n;
+  E.dirty++;
+  E.edits++;
+}
+void editorDelrow(int at){
+  if(at<0 || at>=E.numrows)return;//validate at
+  if(!E.undo.replaying){
+    erow &row=E.row[at];
+    undoRecord(UNDO_ROW_DELETE,at,0,row.chars.data(),row.size);
+  }
+  E.row.erase(at);//frees the row, or leaves it to a snapshot still reading it
+  if(at<E.hl_last_known)E.hl_last_known--;
+  hlMarksDrop(at);
+  hlMarksEdited(at);
+  E.numrows--;
+  E.dirty++;
+  E.edits++;
+}
+void editorRowInsertString(int at, int col, const char *s, size_t len){
+  erow *row=&E.row.edit(at);
+  if (col < 0 || col > row->size) col = row->size;
+  undoRecord(UNDO_INSERT,at,col,s,len);
+  row->chars.insert(col,s,len);
+  row->size=row->chars.size();
+  if(row->cols)colsEdit(row,col,0,len);
+  row->hlgen=0;
+  hlMarksEdited(at);
+  E.dirty++;
+  E.edits++;
+}
+void editorRowDelChars(int at, int col, size_t len){
+  if(col<0 || col>=E.row[at].size) return;//nothing to delete: leave the row clean
+  erow *row=&E.row.edit(at);
+  if(len>(size_t)(row->size-col))len=row->size-col;
+  undoRecord(UNDO_DELETE,at,col,row->chars.data()+col,len);
+  row->chars.erase(col,len);
+  row->size=row->chars.size();
+  if(row->cols)colsEdit(row,col,len,0);
+  row->hlgen=0;
+  hlMarksEdited(at);
+  E.dirty++;
+  E.edits++;
+}
+void editorRowInsert(int at,int col,int x){
+  char c=x;
+  editorRowInsertString(at,col,&c,1);
+}
+/** editor operations**/
+void editorInsertChar(int c){
+  if(E.cy==E.numrows){
+    editorInsertRow(E.numrows,"",0);
+  }
+  editorRowInsert(E.cy,E.cx,c);
+  editorSyntaxPropagate(E.cy,E.cy);
+  E.cx++;
+}
+void editorInsertNewline(){
+  if(E.cx==0){
+    editorInsertRow(E.cy,"",0);
+
+  }else{
+    //the tail leaves the row before its copy goes in below, so that redo
+    //ends on the new row
+    std::string tail=E.row[E.cy].chars.substr(E.cx);
+    editorRowDelChars(E.cy,E.cx,tail.size());
+    editorInsertRow(E.cy+1,tail.data(),tail.size());
+  }
+  editorSyntaxPropagate(E.cy,E.cy);
+  E.cy++;
+  E.cx=0;
+}
+//inserts text at the cursor in one go, as for a paste: the lines are split
+//out and their rows built in one pass, instead of a keypress for every byte
+void editorInsertText(const char *s, size_t len){
+  if(len==0)return;
+  if(E.cy==E.numrows){
+    editorInsertRow(E.numrows,"",0);
+    E.cx=0;
+  }
+  //the cursor can be past the end of the row, left there by a page key
+  if(E.cx>E.row[E.cy].size)E.cx=E.row[E.cy].size;
+  //pasted line breaks come as \r from most terminals, \r\n or \n from some
+  std::vector<std::string> lines;
+  size_t from=0;
+  for(size_t i=0;i<=len;i++){
+    if(i<len&&s[i]!='\r'&&s[i]!='\n')continue;
+    lines.push_back(std::string(s+from,i-from));
+    if(i+1<len&&s[i]=='\r'&&s[i+1]=='\n')i++;
+    from=i+1;
+  }
+  int at=E.cy;
+  if(lines.size()==1){
+    editorRowInsertString(at,E.cx,s,len);
+    E.cx+=len;
+  }else{
+    std::string tail=E.row[at].chars.substr(E.cx);
+    editorRowDelChars(at,E.cx,tail.size());
+    editorRowInsertString(at,E.cx,lines[0].data(),lines[0].size());
+    E.cx=lines.back().size();
+    lines.back()+=tail;
+    editorInsertRows(at+1,lines,1);
+    E.cy=at+lines.size()-1;
+  }
+  editorSyntaxPropagate(at,at+lines.size()-1);
+}
+void editorRowAppendString(int at, const char *s, size_t len){
+  editorRowInsertString(at,E.row[at].size,s,len);
+}
+void editorRowDelChar(int at, int col){
+  editorRowDelChars(at,col,1);
+}
+void editorDelChar(){
+  if(E.cy==E.numrows) return;
+  if(E.cx==0 &&E.cy==0)return;
+  if(E.cx>0){
+    editorRowDelChar(E.cy,E.cx-1);
+    E.cx--;
+  }else{
+  std::string line=E.row[E.cy].chars.substr(0);
+  E.cx=E.row[E.cy-1].size;
+  editorRowAppendString(E.cy-1,line.data(),line.size());
+  editorDelrow(E.cy);
+  E.cy--;}
+  editorSyntaxPropagate(E.cy,E.cy);
+}
+/** undo **/
+//applies op, or takes it back when undo is set. returns the first row touched
+int undoApply(const undoop &op, bool undo){
+  editorHistory &U=E.undo;
+  const char *s=U.text.data()+(op.off-U.base);
+  std::string rev;
+  if(op.back){
+    rev.assign(s,op.len);
+    std::reverse(rev.begin(),rev.end());
+    s=rev.data();
+  }
+  bool insert=(op.kind==UNDO_INSERT||op.kind==UNDO_ROW_INSERT)!=undo;
+  if(op.kind==UNDO_INSERT||op.kind==UNDO_DELETE){
+    if(insert)editorRowInsertString(op.row,op.col,s,op.len);
+    else editorRowDelChars(op.row,op.col,op.len);
+  }else{
+    if(insert)editorInsertRow(op.row,s,op.len);
+    else editorDelrow(op.row);
+  }
+  return op.row;
+}
+//widens [top,bot] to the rows a step changed, so they are all re-lexed. a row
+//inserted above shifts the rows already touched down by one
+void undoTouched(const undoop &op, bool undo, int at, int *top, int *bot){
+  bool insert=(op.kind==UNDO_INSERT||op.kind==UNDO_ROW_INSERT)!=undo;
+  bool rows=op.kind==UNDO_ROW_INSERT||op.kind==UNDO_ROW_DELETE;
+  if(rows&&insert&&*bot>=at)(*bot)++;
+  if(at<*top)*top=at;
+  if(at>*bot)*bot=at;
+}
+void editorUndo(){
+  editorHistory &U=E.undo;
+  if(U.done==U.first){
+    editorStatusMessage("nothing to undo");
+    return;
+  }
+  unsigned long step=U.ops[U.done-1].step;
+  int top=E.numrows,bot=-1;
+  U.replaying=true;
+  while(U.done>U.first&&U.ops[U.done-1].step==step){
+    U.done--;
+    int at=undoApply(U.ops[U.done],true);
+    undoTouched(U.ops[U.done],true,at,&top,&bot);
+  }
+  U.replaying=false;
+  E.cx=U.ops[U.done].bx;
+  E.cy=U.ops[U.done].by;
+  editorSyntaxPropagate(top>0?top-1:0,bot);
+}
+void editorRedo(){
+  editorHistory &U=E.undo;
+  if(U.done==U.ops.size()){
+    editorStatusMessage("nothing to redo");
+    return;
+  }
+  unsigned long step=U.ops[U.done].step;
+  int top=E.numrows,bot=-1;
+  U.replaying=true;
+  while(U.done<U.ops.size()&&U.ops[U.done].step==step){
+    int at=undoApply(U.ops[U.done],false);
+    undoTouched(U.ops[U.done],false,at,&top,&bot);
+    U.done++;
+  }
+  U.replaying=false;
+  E.cx=U.ops[U.done-1].ax;
+  E.cy=U.ops[U.done-1].ay;
+  editorSyntaxPropagate(top>0?top-1:0,bot);
+}
+/*** highlight worker ***/
+//syntax highlighting runs on a worker thread. the draw path posts a snapshot
+//of every visible row whose hl is out of date and draws the row plain until
+//the result is in. jobs go out over a single-producer ring and come back
+//through their done flag, so drawing never waits on a lock
+//a mark job instead lexes every row from one known mark on and keeps the
+//state at each later mark, so drawing far down a file never lexes all the
+//rows above it first. it gets the rows as pieces of the mapped file and
+//copies of the edited rows
+struct hlpiece {
+  const char *s;//lines of the mapped file, NULL for an edited row copied to the job
+  size_t off, len;//off: where in the job's text the copy is
+  int lines;
+};
+struct hljob {
+  unsigned id;//also stored in erow::hl_job, never reused
+  int at;//row number when posted, used to skip rows that scrolled away. -1 for a mark job
+  int start;//lexer state the row starts in
+  struct editorSyntax *syntax;
+  std::string text;//copy of the rendered text
+  unsigned char *hl;//result, NULL if the job was skipped
+  int end;//result: lexer state at the end of the row
+  std::atomic<bool> done;
+  int first;//mark jobs: the mark lexing starts at, in state start
+  std::vector<hlpiece> pieces;//mark jobs: the rows from mark first on
+  std::vector<int> marks;//mark jobs, result: state at every mark after first
+  std::atomic<bool> cancel;//mark jobs: the map is about to go
+};
+#define HL_QUEUE 512
+struct editorHighlighter {
+  hljob *queue[HL_QUEUE];
+  std::atomic<unsigned> head, tail;//the worker pops at head, the draw path pushes at tail
+  std::atomic<int> view_lo, view_hi;//rows on screen, jobs for other rows are skipped
+  sem_t pending;//counts queued jobs
+  bool running;
+  unsigned nextid;
+  std::unordered_map<unsigned, hljob*> jobs;//posted and not collected yet, draw thread only
+  hljob *marks;//mark job posted and not collected yet
+};
+editorHighlighter H;
+
+void hlLexMarks(hljob *job){
+  int state=job->start,n=0;
+  for(size_t i=0;i<job->pieces.size();i++){
+    const hlpiece &p=job->pieces[i];
+    const char *s=p.s?p.s:job->text.data()+p.off,*end=s+p.len;
+    for(int l=0;l<p.lines;l++){
+      if(n%KILO_HL_MARK==0&&job->cancel.load(std::memory_order_relaxed))return;
+      const char *next=end;
+      int len=p.len;
+      if(p.s){//same as editorLazyLine
+        const char *nl=(const char*)memchr(s,'\n',end-s);
+        if(nl)next=nl+1;
+        len=next-s;
+        while(len>0&&(s[len-1]=='\n'||s[len-1]=='\r'))len--;
+      }
+      state=editorSyntaxLex(job->syntax,s,len,state,NULL);
+      s=next;
+      if(++n%KILO_HL_MARK==0)job->marks.push_back(state);
+    }
+  }
+}
+
+void hlWorker(){
+  while(true){
+    while(sem_wait(&H.pending)==-1&&errno==EINTR);
+    unsigned h=H.head.load(std::memory_order_relaxed);
+    hljob *job=H.queue[h%HL_QUEUE];
+    H.head.store(h+1,std::memory_order_release);
+    //viewport first: rows that left the screen since they were posted wait
+    //until they are drawn again
+    if(job->at<0){
+      hlLexMarks(job);
+    }else if(job->at>=H.view_lo.load(std::memory_order_relaxed)&&
+       job->at<H.view_hi.load(std::memory_order_relaxed)){
+      job->hl=(unsigned char*)malloc(job->text.size()+1);
+      job->end=editorSyntaxLex(job->syntax,job->text.data(),job->text.size(),job->start,job->hl);
+    }
+    job->done.store(true,std::memory_order_release);
+    if(H.head.load(std::memory_order_acquire)==H.tail.load(std::memory_order_acquire)){
+      editorWake();
+    }
+  }
+}
+void hlStart(){
+  if(H.running)return;
+  sem_init(&H.pending,0,0);
+  std::thread(hlWorker).detach();
+  H.running=true;
+}
+//hands job to the worker, false if the queue is full
+bool hlQueue(hljob *job){
+  hlStart();
+  if(!H.running)return false;
+  unsigned t=H.tail.load(std::memory_order_relaxed);
+  if(t-H.head.load(std::memory_order_acquire)>=HL_QUEUE)return false;
+  job->done.store(false,std::memory_order_relaxed);
+  H.queue[t%HL_QUEUE]=job;
+  H.tail.store(t+1,std::memory_order_release);
+  sem_post(&H.pending);
+  return true;
+}
+void hlPost(erow *row, int at, int start){
+  hljob *job=new hljob();
+  if(++H.nextid==0)H.nextid=1;
+  job->id=H.nextid;
+  job->at=at;
+  job->start=start;
+  job->syntax=E.syntax;
+  job->text.assign(editorRowRender(row),row->rsize);
+  job->hl=NULL;
+  if(!hlQueue(job)){//full, try next frame
+    delete job;
+    return;
+  }
+  H.jobs[job->id]=job;
+  row->hl_job=job->id;
+}
+//takes the result of row's job if it is finished and still fits the row.
+//returns whether the spans of row are now up to date
+bool hlCollect(erow *row, int at, int start){
+  std::unordered_map<unsigned, hljob*>::iterator it=H.jobs.find(row->hl_job);
+  if(it==H.jobs.end()){
+    row->hl_job=0;
+    return false;
+  }
+  hljob *job=it->second;
+  if(!job->done.load(std::memory_order_acquire))return false;
+  H.jobs.erase(it);
+  row->hl_job=0;
+  bool ok=job->hl&&job->start==start&&job->syntax==E.syntax;
+  if(ok){
+    hlPack(row,job->hl,job->text.size());
+    row->hl_start=start;
+    editorSetRowState(at,row,job->end);
+  }
+  free(job->hl);
+  delete job;
+  return ok;
+}
+//takes the marks the worker found. those past a row changed since are stale
+void hlMarksCollect(){
+  hljob *job=H.marks;
+  if(!job||!job->done.load(std::memory_order_acquire))return;
+  H.marks=NULL;
+  if(!job->cancel.load(std::memory_order_relaxed)&&job->syntax==E.syntax){
+    for(size_t i=0;i<job->marks.size();i++){
+      int k=job->first+1+i;
+      if(k*KILO_HL_MARK>E.hl_marks_edit)break;
+      hlMarkSet(k,job->marks[i]);
+    }
+  }
+  delete job;
+}
+//asks the worker for the marks down to the one before row at, starting from
+//the last one known. without async highlighting it lexes them right away
+void hlMarksPost(int at){
+  if(H.marks)return;//one at a time, a later frame asks again
+  int to=at/KILO_HL_MARK,k=to;
+  while(hlMark(k)<0)k--;
+  hljob *job=new hljob();
+  job->at=-1;
+  job->first=k;
+  job->start=hlMark(k);
+  job->syntax=E.syntax;
+  job->hl=NULL;
+  job->cancel.store(false,std::memory_order_relaxed);
+  E.row.forEachNode(k*KILO_HL_MARK,to*KILO_HL_MARK,[&](int base,rownode *t){
+    int lo=std::max(base,k*KILO_HL_MARK),hi=std::min(base+t->lines,to*KILO_HL_MARK);
+    int line=t->first>=0?t->first+lo-base:t->orig;
+    if(line>=0){//still as in the mapped file
+      const char *s=E.map+lineStart(line);
+      size_t len=lineStart(line+hi-lo)-lineStart(line);
+      hlpiece *last=job->pieces.empty()?NULL:&job->pieces.back();
+      if(last&&last->s&&last->s+last->len==s){
+        last->len+=len;
+        last->lines+=hi-lo;
+      }else{
+        job->pieces.push_back(hlpiece{s,0,len,hi-lo});
+      }
+    }else{
+      job->pieces.push_back(hlpiece{NULL,job->text.size(),(size_t)t->row.size,1});
+      job->text.append(t->row.chars.data(),t->row.size);
+    }
+    return true;
+  });
+  E.hl_marks_edit=E.numrows;
+  H.marks=job;
+  if(!E.hl_async){
+    hlLexMarks(job);
+    job->done.store(true,std::memory_order_release);
+    hlMarksCollect();
+  }else if(!hlQueue(job)){
+    H.marks=NULL;
+    delete job;
+  }
+}
+//stops the mark job and waits for it, before the map it reads goes
+void hlMarksCancel(){
+  hljob *job=H.marks;
+  if(!job)return;
+  job->cancel.store(true,std::memory_order_relaxed);
+  while(!job->done.load(std::memory_order_acquire))std::this_thread::yield();
+  H.marks=NULL;
+  delete job;
+}
+//frees finished jobs no row collected: their rows changed or scrolled away
+void hlSweep(){
+  std::unordered_map<unsigned, hljob*>::iterator it=H.jobs.begin();
+  while(it!=H.jobs.end()){
+    hljob *job=it->second;
+    if(job->done.load(std::memory_order_acquire)){
+      free(job->hl);
+      delete job;
+      it=H.jobs.erase(it);
+    }else{
+      it++;
+    }
+  }
+}
+//readies row number at for drawing. returns whether its hl is ready too,
+//false while the worker is still on it
+bool editorRowHighlight(erow *row, int at, int start){
+  if(!E.hl_async||E.syntax==NULL||editorRowCols(row)){
+    editorRenderRow(row,start);
+    return true;
+  }
+  if(row->hlgen!=E.hlgen)editorUpdateRender(row);
+  if(row->hl_start==start)return true;
+  if(row->hl_job&&hlCollect(row,at,start))return true;
+  if(!row->hl_job)hlPost(row,at,start);
+  return false;
+}
+//readies row for drawing without hl, while the state it starts in is unknown
+void editorRowPlain(erow *row){
+  rowcols *c=editorRowCols(row);
+  if(c){//a slice lexed from the normal state, only its render is used
+    if(row->hlgen!=E.hlgen||c->rx0<0||c->coloff!=E.coloff||c->screencols!=E.screencols)
+      colsRenderSlice(c,row,HLS_NORMAL);
+    return;
+  }
+  if(row->hlgen!=E.hlgen)editorUpdateRender(row);
+}
+//lexer state at the end of row number at, given the state it starts in
+int editorRowEndState(erow *row, int at, int start){
+  if(row->stategen!=E.hlgen)
+    editorSetRowState(at,row,editorRowLex(row,row->chars.data(),row->size,start));
+  return row->hl_open;
+}
+
+/*** line index ***/
+//each scanner appends the offset just past every '\n' in map[from,to) to out
+//and returns how many of those newlines were preceded by '\r'
+int indexScalar(const char *map, size_t from, size_t to, std::vector<size_t> &out){
+  int crlf=0;
+  const char *p=map+from,*end=map+to;
+  while((p=(const char*)memchr(p,'\n',end-p))!=NULL){
+    if(p>map&&p[-1]=='\r')crlf++;
+    p++;
+    out.push_back(p-map);
+  }
+  return crlf;
+}
+#if defined(__SSE2__)
+int indexSSE2(const char *map, size_t from, size_t to, std::vector<size_t> &out){
+  const __m128i nl=_mm_set1_epi8('\n');
+  int crlf=0;
+  size_t i=from;
+  for(;i+16<=to;i+=16){
+    __m128i v=_mm_loadu_si128((const __m128i*)(map+i));
+    unsigned mask=_mm_movemask_epi8(_mm_cmpeq_epi8(v,nl));
+    while(mask){
+      size_t at=i+__builtin_ctz(mask);
+      if(at>0&&map[at-1]=='\r')crlf++;
+      out.push_back(at+1);
+      mask&=mask-1;
+    }
+  }
+  return crlf+indexScalar(map,i,to,out);
+}
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KILO_HAVE_AVX2
+__attribute__((target("avx2")))
+int indexAVX2(const char *map, size_t from, size_t to, std::vector<size_t> &out){
+  const __m256i nl=_mm256_set1_epi8('\n');
+  int crlf=0;
+  size_t i=from;
+  for(;i+32<=to;i+=32){
+    __m256i v=_mm256_loadu_si256((const __m256i*)(map+i));
+    unsigned mask=_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,nl));
+    while(mask){
+      size_t at=i+__builtin_ctz(mask);
+      if(at>0&&map[at-1]=='\r')crlf++;
+      out.push_back(at+1);
+      mask&=mask-1;
+    }
+  }
+  return crlf+indexScalar(map,i,to,out);
+}
+#endif
+typedef int (*indexScanner)(const char*, size_t, size_t, std::vector<size_t>&);
+indexScanner indexPickScanner(){
+#ifdef KILO_HAVE_AVX2
+  if(__builtin_cpu_supports("avx2"))return indexAVX2;
+#endif
+#if defined(__SSE2__)
+  return indexSSE2;
+#else
+  return indexScalar;
+#endif
+}
+//drops the pages of map[from,to) a paged file was read through. nothing in
+//them was written, so they are read back from the file if used again
+void editorPageOut(size_t from, size_t to){
+  static size_t page=sysconf(_SC_PAGESIZE);
+  if(!E.index.paged)return;
+  from=(from+page-1)/page*page;
+  to=to<E.mapsize?to/page*page:E.mapsize;
+  if(from<to)madvise((void*)(E.map+from),to-from,MADV_DONTNEED);
+}
+//fills E.index for E.map. the file is cut in KILO_INDEX_CHUNK pieces scanned
+//on their own threads, and the per-chunk offsets are concatenated in order.
+//a paged file only counts the newlines of each block and drops what it read
+void editorIndexLines(){
+  static indexScanner scan=indexPickScanner();
+  lineIndex &X=E.index;
+  size_t nchunks=E.mapsize/KILO_INDEX_CHUNK+1;
+  size_t nthreads=std::thread::hardware_concurrency();
+  if(nthreads==0)nthreads=1;
+  if(nchunks>nthreads)nchunks=nthreads;
+  size_t chunk=E.mapsize/nchunks;
+  size_t nblocks=(E.mapsize+KILO_PAGE_BLOCK-1)/KILO_PAGE_BLOCK;
+  if(X.paged)chunk=nblocks/nchunks*KILO_PAGE_BLOCK;
+
+  std::vector<std::vector<size_t> > offs(nchunks);
+  std::vector<int> crlf(nchunks);
+  X.nl.assign(X.paged?nblocks+1:0,0);
+  auto work=[&offs,&crlf,&X](size_t c, size_t from, size_t to){
+    if(!X.paged){
+      offs[c].reserve((to-from)/64);
+      crlf[c]=scan(E.map,from,to,offs[c]);
+      return;
+    }
+    std::vector<size_t> tmp;
+    size_t read=from;
+    for(size_t at=from;at<to;at+=KILO_PAGE_BLOCK){
+      size_t end=std::min(at+KILO_PAGE_BLOCK,to);
+      tmp.clear();
+      crlf[c]+=scan(E.map,at,end,tmp);
+      X.nl[at/KILO_PAGE_BLOCK+1]=tmp.size();
+      if(end-read>=KILO_INDEX_CHUNK||end==to){
+        editorPageOut(read,end);
+        read=end;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for(size_t c=1;c<nchunks;c++){//the calling thread takes the first chunk itself, below
+    size_t from=c*chunk;
+    size_t to=c==nchunks-1?E.mapsize:from+chunk;
+    workers.push_back(std::thread(work,c,from,to));
+  }
+  work(0,0,nchunks==1?E.mapsize:chunk);
+  for(size_t c=0;c<workers.size();c++)workers[c].join();
+
+  int ncrlf=0;
+  for(size_t c=0;c<nchunks;c++)ncrlf+=crlf[c];
+  size_t newlines;
+  X.off.clear();
+  if(X.paged){
+    for(size_t b=0;b<nblocks;b++)X.nl[b+1]+=X.nl[b];
+    newlines=X.nl.back();
+  }else{
+    size_t total=1;
+    for(size_t c=0;c<nchunks;c++)total+=offs[c].size();
+    X.off.reserve(total+1);
+    X.off.push_back(0);
+    for(size_t c=0;c<nchunks;c++){
+      X.off.insert(X.off.end(),offs[c].begin(),offs[c].end());
+      std::vector<size_t>().swap(offs[c]);
+    }
+    newlines=total-1;
+    //a newline at the very end does not start another line
+    if(X.off.back()==E.mapsize)X.off.pop_back();
+    X.off.push_back(E.mapsize);
+  }
+  X.lines=newlines+(E.map[E.mapsize-1]!='\n');
+  E.crlf=newlines>0&&(size_t)ncrlf==newlines;
+}
+//offset in the map where line starts, mapsize for the line after the last
+size_t lineStart(int line){
+  const lineIndex &X=E.index;
+  if(!X.paged)return X.off[line];
+  if(line<=0)return 0;
+  if(line>=X.lines)return E.mapsize;
+  //line starts after newline number line, which is in the last block with
+  //fewer newlines than that before it. a scan that ended at or past that
+  //block's start on this thread is a closer place to start from
+  static thread_local unsigned long cgen;
+  static thread_local int cline;
+  static thread_local size_t coff;
+  size_t b=std::lower_bound(X.nl.begin(),X.nl.end()-1,(size_t)line)-X.nl.begin()-1;
+  size_t off=b*KILO_PAGE_BLOCK;
+  size_t skip=line-X.nl[b];
+  if(cgen==X.gen&&cline<=line&&coff>=off){
+    off=coff;
+    skip=line-cline;
+  }
+  for(;skip>0;skip--){
+    const char *p=(const char*)memchr(E.map+off,'\n',E.mapsize-off);
+    off=p-E.map+1;
+  }
+  cgen=X.gen;
+  cline=line;
+  coff=off;
+  return off;
+}
+//the last line in [lo,hi) starting at or before map offset off, lo-1 if none
+int lineAt(size_t off, int lo, int hi){
+  const lineIndex &X=E.index;
+  if(!X.paged)return std::upper_bound(X.off.begin()+lo,X.off.begin()+hi,off)-X.off.begin()-1;
+  size_t line;
+  if(off>=E.mapsize){
+    line=X.lines;
+  }else{
+    size_t b=off/KILO_PAGE_BLOCK;
+    line=X.nl[b];
+    for(const char *p=E.map+b*KILO_PAGE_BLOCK,*end=E.map+off;
+        (p=(const char*)memchr(p,'\n',end-p))!=NULL;p++)line++;
+  }
+  if(line<(size_t)lo)return lo-1;
+  return line<(size_t)hi?(int)line:hi-1;
+}
+
+/*** regex ***/
+//a small regex engine for the find prompt. a pattern is parsed to a tree,
+//compiled to a thompson nfa program, and matched with a dfa that is built
+//lazily from sets of nfa states. only word boundaries, which depend on the
+//byte after the current one, make a pattern fall back to simulating the nfa
+#define RE_MAX_INST 20000//program size a pattern may compile to
+#define RE_MAX_REPEAT 1000//largest count in {m,n}
+#define RE_DFA_STATES 4096//dfa states cached before the cache is flushed
+
+enum reOp{
+  RE_CLASS,//consume a byte in class x
+  RE_SPLIT,//go on at both x and y
+  RE_JMP,//go on at x
+  RE_BOL,//the assertions go on at the next instruction if they hold
+  RE_EOL,
+  RE_WORDB,
+  RE_NWORDB,
+  RE_MATCH
+};
+struct reinst {
+  int op;
+  int x, y;
+};
+struct reclass {
+  unsigned char bits[32];
+};
+struct reprog {
+  std::vector<reinst> code;
+  std::vector<reclass> classes;
+  std::string literal;//bytes every match contains, lines without them are skipped
+  bool first[256];//bytes a non-empty match can start with
+  bool nfa;//has word boundaries, matched without the dfa
+  std::string error;
+};
+
+/** parser **/
+enum rxType{ RX_CLASS, RX_CAT, RX_ALT, RX_REPEAT, RX_ASSERT };
+struct rxnode {
+  int type;
+  int arg;//RX_CLASS: class, RX_ASSERT: reOp
+  int min, max;//RX_REPEAT, max is -1 for no limit
+  std::vector<int> kids;
+};
+struct reparser {
+  const char *p, *end;
+  reprog *re;
+  std::vector<rxnode> nodes;
+  std::string error;
+};
+void reclassSet(reclass &c, int lo, int hi){
+  for(int i=lo;i<=hi;i++)c.bits[i>>3]|=1<<(i&7);
+}
+bool reclassHas(const reclass &c, int b){
+  return c.bits[b>>3]&(1<<(b&7));
+}
+//the only byte in c, or -1
+int reclassSingle(const reclass &c){
+  int b=-1;
+  for(int i=0;i<256;i++){
+    if(!reclassHas(c,i))continue;
+    if(b>=0)return -1;
+    b=i;
+  }
+  return b;
+}
+//adds \d \w \s or their upper case negations to c, false for other letters
+bool reclassEscape(reclass &c, int e){
+  reclass t;
+  memset(&t,0,sizeof(t));
+  switch(tolower(e)){
+    case 'd': reclassSet(t,'0','9'); break;
+    case 'w': reclassSet(t,'0','9'); reclassSet(t,'a','z'); reclassSet(t,'A','Z'); reclassSet(t,'_','_'); break;
+    case 's': reclassSet(t,' ',' '); reclassSet(t,'\t','\r'); break;
+    default: return false;
+  }
+  for(int i=0;i<32;i++)c.bits[i]|=isupper(e)?~t.bits[i]:t.bits[i];
+  return true;
+}
+int reHex(int c){
+  if(c>='0'&&c<='9')return c-'0';
+  c=tolower(c);
+  return c>='a'&&c<='f'?c-'a'+10:-1;
+}
+//the byte escape e stands for, with P->p just past e
+int reEscapeByte(reparser *P, int e){
+  switch(e){
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'x':
+      if(P->end-P->p>=2&&reHex(P->p[0])>=0&&reHex(P->p[1])>=0){
+        int b=reHex(P->p[0])*16+reHex(P->p[1]);
+        P->p+=2;
+        return b;
+      }
+      return 'x';
+  }
+  return (unsigned char)e;
+}
+int rxNew(reparser *P, int type, int arg){
+  rxnode n;
+  n.type=type;
+  n.arg=arg;
+  n.min=n.max=0;
+  P->nodes.push_back(n);
+  return P->nodes.size()-1;
+}
+int rxClass(reparser *P, const reclass &c){
+  P->re->classes.push_back(c);
+  return rxNew(P,RX_CLASS,P->re->classes.size()-1);
+}
+int reAlt(reparser *P);
+int reBracket(reparser *P){
+  reclass c;
+  memset(&c,0,sizeof(c));
+  bool neg=P->p<P->end&&*P->p=='^';
+  if(neg)P->p++;
+  for(bool first=true;;first=false){
+    if(P->p==P->end){
+      P->error="missing ]";
+      return -1;
+    }
+    int lo=(unsigned char)*P->p++;
+    if(lo==']'&&!first)break;
+    if(lo=='\\'&&P->p<P->end){
+      int e=*P->p++;
+      if(reclassEscape(c,e))continue;
+      lo=reEscapeByte(P,e);
+    }
+    int hi=lo;
+    if(P->end-P->p>=2&&P->p[0]=='-'&&P->p[1]!=']'){
+      P->p++;
+      hi=(unsigned char)*P->p++;
+      if(hi=='\\'&&P->p<P->end)hi=reEscapeByte(P,*P->p++);
+      if(hi<lo){
+        P->error="bad range";
+        return -1;
+      }
+    }
+    reclassSet(c,lo,hi);
+  }
+  if(neg)for(int i=0;i<32;i++)c.bits[i]=~c.bits[i];
+  return rxClass(P,c);
+}
+int reAtom(reparser *P){
+  reclass c;
+  memset(&c,0,sizeof(c));
+  int ch=(unsigned char)*P->p++;
+  switch(ch){
+    case '(': {
+      if(P->end-P->p>=2&&P->p[0]=='?'&&P->p[1]==':')P->p+=2;//groups never capture anyway
+      int n=reAlt(P);
+      if(n<0)return -1;
+      if(P->p==P->end||*P->p!=')'){
+        P->error="missing )";
+        return -1;
+      }
+      P->p++;
+      return n;
+    }
+    case '.'://lines hold no newline, so any byte
+      reclassSet(c,0,255);
+      return rxClass(P,c);
+    case '^': return rxNew(P,RX_ASSERT,RE_BOL);
+    case '$': return rxNew(P,RX_ASSERT,RE_EOL);
+    case '[': return reBracket(P);
+    case '*': case '+': case '?':
+      P->error="nothing to repeat";
+      return -1;
+    case '\\':
+      if(P->p==P->end){
+        P->error="trailing \\";
+        return -1;
+      }
+      ch=*P->p++;
+      if(ch=='b'||ch=='B'){
+        P->re->nfa=true;
+        return rxNew(P,RX_ASSERT,ch=='b'?RE_WORDB:RE_NWORDB);
+      }
+      if(reclassEscape(c,ch))return rxClass(P,c);
+      ch=reEscapeByte(P,ch);
+      break;
+  }
+  reclassSet(c,ch,ch);
+  return rxClass(P,c);
+}
+//parses {m}, {m,} or {m,n} at P->p. returns 0 and leaves P->p alone if the
+//brace does not start a count, so it is taken literally
+int reBraces(reparser *P, int *min, int *max){
+  const char *p=P->p+1;
+  int n[2]={0,-1},k=0;
+  for(;k<2;k++){
+    if(p==P->end)return 0;
+    if(isdigit(*p)){
+      n[k]=0;
+      while(p<P->end&&isdigit(*p)&&n[k]<=RE_MAX_REPEAT)n[k]=n[k]*10+*p++-'0';
+    }else if(k==0){
+      return 0;
+    }
+    if(p<P->end&&*p=='}'){
+      if(k==0)n[1]=n[0];
+      break;
+    }
+    if(k==1||p==P->end||*p!=',')return 0;
+    p++;
+  }
+  if(p==P->end||*p!='}')return 0;
+  if(n[0]>RE_MAX_REPEAT||n[1]>RE_MAX_REPEAT||(n[1]>=0&&n[1]<n[0])){
+    P->error="bad repeat count";
+    return -1;
+  }
+  P->p=p+1;
+  *min=n[0];
+  *max=n[1];
+  return 1;
+}
+int reRepeat(reparser *P){
+  int n=reAtom(P);
+  while(n>=0&&P->p<P->end){
+    int min,max;
+    char c=*P->p;
+    if(c=='*'||c=='+'||c=='?'){
+      min=c=='+';
+      max=c=='?'?1:-1;
+      P->p++;
+    }else if(c=='{'){
+      int r=reBraces(P,&min,&max);
+      if(r<0)return -1;
+      if(r==0)break;
+    }else{
+      break;
+    }
+    if(P->p<P->end&&*P->p=='?')P->p++;//lazy or not, matches are leftmost-longest
+    int r=rxNew(P,RX_REPEAT,0);
+    P->nodes[r].min=min;
+    P->nodes[r].max=max;
+    P->nodes[r].kids.push_back(n);
+    n=r;
+  }
+  return n;
+}
+int reCat(reparser *P){
+  int n=rxNew(P,RX_CAT,0);
+  while(P->p<P->end&&*P->p!='|'&&*P->p!=')'){
+    int k=reRepeat(P);
+    if(k<0)return -1;
+    P->nodes[n].kids.push_back(k);
+  }
+  return n;
+}
+int reAlt(reparser *P){
+  int n=reCat(P);
+  if(n<0||P->p==P->end||*P->p!='|')return n;
+  int a=rxNew(P,RX_ALT,0);
+  P->nodes[a].kids.push_back(n);
+  while(P->p<P->end&&*P->p=='|'){
+    P->p++;
+    int k=reCat(P);
+    if(k<0)return -1;
+    P->nodes[a].kids.push_back(k);
+  }
+  return a;
+}
+//appends the program for node n to P->re->code
+bool reEmit(reparser *P, int n){
+  std::vector<reinst> &code=P->re->code;
+  if(code.size()>RE_MAX_INST){
+    P->error="pattern too big";
+    return false;
+  }
+  rxnode nd=P->nodes[n];
+  reinst in={RE_JMP,0,0};
+  switch(nd.type){
+    case RX_CLASS:
+      in.op=RE_CLASS;
+      in.x=nd.arg;
+      code.push_back(in);
+      break;
+    case RX_ASSERT:
+      in.op=nd.arg;
+      code.push_back(in);
+      break;
+    case RX_CAT:
+      for(size_t i=0;i<nd.kids.size();i++)
+        if(!reEmit(P,nd.kids[i]))return false;
+      break;
+    case RX_ALT: {
+      std::vector<int> jumps;
+      for(size_t i=0;i<nd.kids.size();i++){
+        int split=code.size();
+        bool last=i+1==nd.kids.size();
+        if(!last){
+          in.op=RE_SPLIT;
+          in.x=split+1;
+          code.push_back(in);
+        }
+        if(!reEmit(P,nd.kids[i]))return false;
+        if(!last){
+          jumps.push_back(code.size());
+          in.op=RE_JMP;
+          code.push_back(in);
+          code[split].y=code.size();
+        }
+      }
+      for(size_t i=0;i<jumps.size();i++)code[jumps[i]].x=code.size();
+      break;
+    }
+    case RX_REPEAT: {
+      for(int i=0;i<nd.min;i++)
+        if(!reEmit(P,nd.kids[0]))return false;
+      if(nd.max<0){
+        int loop=code.size();
+        in.op=RE_SPLIT;
+        in.x=loop+1;
+        code.push_back(in);
+        if(!reEmit(P,nd.kids[0]))return false;
+        in.op=RE_JMP;
+        in.x=loop;
+        code.push_back(in);
+        code[loop].y=code.size();
+        break;
+      }
+      std::vector<int> splits;
+      for(int i=nd.min;i<nd.max;i++){
+        splits.push_back(code.size());
+        in.op=RE_SPLIT;
+        in.x=code.size()+1;
+        code.push_back(in);
+        if(!reEmit(P,nd.kids[0]))return false;
+      }
+      for(size_t i=0;i<splits.size();i++)code[splits[i]].y=code.size();
+      break;
+    }
+  }
+  return true;
+}
+//longest run of bytes every match of node n contains
+std::string reRequired(reparser *P, int n){
+  const rxnode &nd=P->nodes[n];
+  if(nd.type==RX_CLASS){
+    int b=reclassSingle(P->re->classes[nd.arg]);
+    return b>=0?std::string(1,(char)b):std::string();
+  }
+  if(nd.type==RX_REPEAT){
+    if(nd.min==0)return std::string();
+    const rxnode &k=P->nodes[nd.kids[0]];
+    int b=k.type==RX_CLASS?reclassSingle(P->re->classes[k.arg]):-1;
+    if(b>=0)return std::string(nd.min<16?nd.min:16,(char)b);//x{60} needs xxx...
+    return reRequired(P,nd.kids[0]);
+  }
+  if(nd.type!=RX_CAT)return std::string();
+  std::string best,run;
+  for(size_t i=0;i<nd.kids.size();i++){
+    const rxnode &k=P->nodes[nd.kids[i]];
+    if(k.type==RX_ASSERT)continue;//takes no bytes, the run goes on
+    int b=k.type==RX_CLASS?reclassSingle(P->re->classes[k.arg]):-1;
+    if(b>=0){
+      run+=(char)b;
+      if(run.size()>best.size())best=run;
+      continue;
+    }
+    run.clear();
+    std::string sub=reRequired(P,nd.kids[i]);
+    if(sub.size()>best.size())best=sub;
+  }
+  return best;
+}
+
+/** matching **/
+//what is known about the position a closure is taken at
+#define RE_AT_BOL 1
+#define RE_AT_EOL 2
+#define RE_WORD_BEFORE 4
+#define RE_WORD_AFTER 8
+#define RE_KEEP_EOL 16//dfa: leave $ in the set, to be decided at the end of the line
+//adds every RE_CLASS and RE_MATCH reachable from pc without consuming a byte
+//to set. instructions marked with gen were added already
+void reClosure(const reprog *re, int pc, int flags, std::vector<int> &set,
+               std::vector<unsigned> &mark, unsigned gen, std::vector<int> &stack){
+  stack.clear();
+  stack.push_back(pc);
+  while(!stack.empty()){
+    pc=stack.back();
+    stack.pop_back();
+    if(mark[pc]==gen)continue;
+    mark[pc]=gen;
+    const reinst &in=re->code[pc];
+    switch(in.op){
+      case RE_JMP:
+        stack.push_back(in.x);
+        break;
+      case RE_SPLIT:
+        stack.push_back(in.y);
+        stack.push_back(in.x);
+        break;
+      case RE_BOL:
+        if(flags&RE_AT_BOL)stack.push_back(pc+1);
+        break;
+      case RE_EOL:
+        if(flags&RE_AT_EOL)stack.push_back(pc+1);
+        else if(flags&RE_KEEP_EOL)set.push_back(pc);
+        break;
+      case RE_WORDB:
+      case RE_NWORDB: {
+        bool edge=!(flags&RE_WORD_BEFORE)!=!(flags&RE_WORD_AFTER);
+        if(edge==(in.op==RE_WORDB))stack.push_back(pc+1);
+        break;
+      }
+      default:
+        set.push_back(pc);
+    }
+  }
+}
+void reFirstBytes(reprog *re){
+  std::vector<unsigned> mark(re->code.size(),0);
+  std::vector<int> set,stack;
+  memset(re->first,0,sizeof(re->first));
+  //every kind of position, since the assertions are not known yet
+  for(int flags=0;flags<16;flags++){
+    set.clear();
+    reClosure(re,0,flags,set,mark,flags+1,stack);
+    for(size_t i=0;i<set.size();i++){
+      const reinst &in=re->code[set[i]];
+      if(in.op!=RE_CLASS)continue;
+      for(int b=0;b<256;b++)
+        if(reclassHas(re->classes[in.x],b))re->first[b]=true;
+    }
+  }
+}
+//compiles pattern into re. returns false with re->error set if it is not valid
+bool reCompile(reprog *re, const std::string &pattern){
+  re->code.clear();
+  re->classes.clear();
+  re->literal.clear();
+  re->error.clear();
+  re->nfa=false;
+  reparser P;
+  P.p=pattern.data();
+  P.end=P.p+pattern.size();
+  P.re=re;
+  int root=reAlt(&P);
+  if(root>=0&&P.p!=P.end)P.error="unmatched )";
+  if(!P.error.empty()||!reEmit(&P,root)){
+    re->error=P.error;
+    return false;
+  }
+  reinst match={RE_MATCH,0,0};
+  re->code.push_back(match);
+  re->literal=reRequired(&P,root);
+  reFirstBytes(re);
+  return true;
+}
+
+#define RE_S_MATCH 1//a match ends before the next byte
+#define RE_S_MATCHEND 2//a match ends here if this is the end of the line
+#define RE_S_DEAD 4//nothing can match from here on
+//a lazily built dfa. each search worker has its own, the program is shared.
+//a state is the sorted set of nfa instructions it stands for: classes,
+//matches, and $ that is not decided until the end of the line
+struct redfa {
+  const reprog *re;
+  bool search;//a match may start at any byte, not only where the scan starts
+  std::vector<std::vector<int> > states;
+  std::vector<int> trans;//256 per state: the state after each byte, -1 until needed
+  std::vector<unsigned char> flags;//RE_S_ bits per state
+  std::map<std::vector<int>, int> index;
+  int start[2];//for the start of the line and anywhere else, -1 until built
+  std::vector<unsigned> mark;
+  unsigned gen;
+  std::vector<int> set, set2, stack;
+};
+void reDfaFlush(redfa *d){
+  d->states.clear();
+  d->trans.clear();
+  d->flags.clear();
+  d->index.clear();
+  d->start[0]=d->start[1]=-1;
+}
+void reDfaInit(redfa *d, const reprog *re, bool search){
+  d->re=re;
+  d->search=search;
+  d->start[0]=d->start[1]=-1;
+  d->mark.assign(re->code.size(),0);
+  d->gen=0;
+}
+//the state for the nfa instructions in set, which gets sorted
+int reDfaState(redfa *d, std::vector<int> &set){
+  std::sort(set.begin(),set.end());
+  std::map<std::vector<int>, int>::iterator it=d->index.find(set);
+  if(it!=d->index.end())return it->second;
+  unsigned char flags=set.empty()?RE_S_DEAD:0;
+  std::vector<int> end;
+  d->gen++;
+  for(size_t i=0;i<set.size();i++){
+    int op=d->re->code[set[i]].op;
+    if(op==RE_MATCH)flags|=RE_S_MATCH|RE_S_MATCHEND;
+    if(op==RE_EOL)reClosure(d->re,set[i]+1,RE_AT_EOL,end,d->mark,d->gen,d->stack);
+  }
+  for(size_t i=0;i<end.size();i++)
+    if(d->re->code[end[i]].op==RE_MATCH)flags|=RE_S_MATCHEND;
+  d->states.push_back(set);
+  d->trans.resize(d->trans.size()+256,-1);
+  d->flags.push_back(flags);
+  d->index[set]=d->states.size()-1;
+  return d->states.size()-1;
+}
+int reDfaStart(redfa *d, bool bol){
+  if(d->start[bol]<0){
+    d->set.clear();
+    d->gen++;
+    reClosure(d->re,0,RE_KEEP_EOL|(bol?RE_AT_BOL:0),d->set,d->mark,d->gen,d->stack);
+    d->start[bol]=reDfaState(d,d->set);
   }
-  return cx;
+  return d->start[bol];
 }
-int editorRowCxtoRx(erow*row,int cx){
-  int rx=0;
-  for(int i=0;i<cx;i++){
-    if(row->chars[i]=='\t')
-    //if its a tab, we use rx%KILO_TAB_STOP
-    //to find how many columns we are to the right of the last tab stop
-    rx+=(KILO_TAB_STOP-1)-(rx%KILO_TAB_STOP);
-    rx++;
+//the state after byte c, built if it is new. the callers' inner loops look
+//into trans themselves and only call this on a miss
+int reDfaStep(redfa *d, int s, unsigned char c){
+  int n=d->trans[s*256+c];
+  if(n>=0)return n;
+  if(d->states.size()>=RE_DFA_STATES){
+    std::vector<int> keep=d->states[s];
+    reDfaFlush(d);
+    s=reDfaState(d,keep);
   }
-  return rx;
+  const reprog *re=d->re;
+  std::vector<int> pcs=d->states[s];
+  d->set.clear();
+  d->gen++;
+  for(size_t i=0;i<pcs.size();i++){
+    const reinst &in=re->code[pcs[i]];
+    if(in.op==RE_CLASS&&reclassHas(re->classes[in.x],c))
+      reClosure(re,pcs[i]+1,RE_KEEP_EOL,d->set,d->mark,d->gen,d->stack);
+  }
+  if(d->search)reClosure(re,0,RE_KEEP_EOL,d->set,d->mark,d->gen,d->stack);
+  n=reDfaState(d,d->set);
+  d->trans[s*256+c]=n;
+  return n;
 }
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
-
-  row->render.resize(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+bool reIsWord(int c){
+  return isalnum(c)||c=='_';
+}
+int reFlagsAt(const char *s, int len, int i){
+  return (i==0?RE_AT_BOL:0)|(i==len?RE_AT_EOL:0)|
+    (i>0&&reIsWord((unsigned char)s[i-1])?RE_WORD_BEFORE:0)|
+    (i<len&&reIsWord((unsigned char)s[i])?RE_WORD_AFTER:0);
+}
+//reLongest for patterns the dfa can't run: a set simulation of the nfa, which
+//never holds more states than the program has instructions
+int reLongestNfa(redfa *d, const char *s, int len, int from){
+  const reprog *re=d->re;
+  std::vector<int> &cur=d->set,&next=d->set2;
+  int last=-1;
+  cur.clear();
+  d->gen++;
+  reClosure(re,0,reFlagsAt(s,len,from),cur,d->mark,d->gen,d->stack);
+  for(int i=from;!cur.empty();i++){
+    for(size_t k=0;k<cur.size();k++)
+      if(re->code[cur[k]].op==RE_MATCH)last=i;
+    if(i==len)break;
+    next.clear();
+    d->gen++;
+    int flags=reFlagsAt(s,len,i+1);
+    for(size_t k=0;k<cur.size();k++){
+      const reinst &in=re->code[cur[k]];
+      if(in.op==RE_CLASS&&reclassHas(re->classes[in.x],(unsigned char)s[i]))
+        reClosure(re,cur[k]+1,flags,next,d->mark,d->gen,d->stack);
     }
+    cur.swap(next);
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  editorUpdateSyntax(row);
+  return last;
 }
-void editorInsertRow(int at,const char *s, size_t len) {
-  if(at<0 || at>E.numrows) return;
-  E.row.insert(E.row.begin()+at,erow());
-  E.row[at].size = len;
-  E.row[at].chars = std::string(s, len);
-  E.row[at].rsize = 0;
-  E.row[at].hl=NULL;
-  editorUpdateRow(&E.row[at]);
-  E.numrows++;
-  E.dirty++;
+//end of the longest match starting at s[from], -1 if none starts there.
+//d must be an anchored dfa
+int reLongest(redfa *d, const char *s, int len, int from){
+  if(d->re->nfa)return reLongestNfa(d,s,len,from);
+  int st=reDfaStart(d,from==0);
+  int last=-1;
+  for(int i=from;;i++){
+    unsigned char f=d->flags[st];
+    if(f&RE_S_MATCH)last=i;
+    if(i==len){
+      if(f&RE_S_MATCHEND)last=len;
+      break;
+    }
+    if(f&RE_S_DEAD)break;
+    int n=d->trans[st*256+(unsigned char)s[i]];
+    st=n>=0?n:reDfaStep(d,st,s[i]);
+  }
+  return last;
 }
-void editorFreeRow(erow *row){
-  row->render.clear();
-  row->chars.clear();
-  free(row->hl);
+//where the first match to end that starts at or after s[from] ends, -1 if
+//nothing there matches. d must be a searching dfa
+int reFirstEnd(redfa *d, const char *s, int len, int from){
+  int st=reDfaStart(d,from==0);
+  const int *trans=d->trans.data();
+  const unsigned char *flags=d->flags.data();
+  for(int i=from;i<len;i++){
+    if(flags[st]&RE_S_MATCH)return i;
+    int n=trans[st*256+(unsigned char)s[i]];
+    if(n<0){
+      n=reDfaStep(d,st,s[i]);
+      trans=d->trans.data();
+      flags=d->flags.data();
+    }
+    st=n;
+  }
+  return flags[st]&RE_S_MATCHEND?len:-1;
 }
-void editorDelrow(int at){
-  if(at<0 || at>=E.numrows)return;//validate at
-  editorFreeRow(&E.row[at]);//free memory owned by the row
-  E.row.erase(E.row.begin()+at);
-  E.numrows--;
-  E.dirty++;
+//the dfas one thread matches a program with
+struct rematcher {
+  redfa anchored, search;
+};
+void reMatcherInit(rematcher *m, const reprog *re){
+  reDfaInit(&m->anchored,re,false);
+  reDfaInit(&m->search,re,true);
 }
-void editorRowInsert(erow *row,int at,int x){
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars.insert(row->chars.begin()+at,x);
-  row->size++;
-  editorUpdateRow(row);
-  E.dirty++;
+void reMatcherFree(rematcher *m){
+  reDfaFlush(&m->anchored);
+  reDfaFlush(&m->search);
 }
-/** editor operations**/
-void editorInsertChar(int c){
-  if(E.cy==E.numrows){
-    editorInsertRow(E.numrows,"",0);
+//calls fn(col,len) for each leftmost-longest non-empty match in s, left to right.
+//the leftmost match starts no later than the first match to end, so only
+//starts up to there are tried, and a line with no match costs one dfa pass
+template<class F> void reEachMatch(rematcher *m, const char *s, int len, F fn){
+  const reprog *re=m->anchored.re;
+  int i=0;
+  while(i<len){
+    int last=len-1;//last start worth trying
+    if(!re->nfa){
+      last=reFirstEnd(&m->search,s,len,i);
+      if(last<0)return;
+      if(last>=len)last=len-1;
+    }
+    int next=last+1;
+    for(;i<=last;i++){
+      if(!re->first[(unsigned char)s[i]])continue;
+      int end=reLongest(&m->anchored,s,len,i);
+      if(end>i){
+        fn(i,end-i);
+        next=end;
+        break;
+      }
+    }
+    i=next;
   }
-  editorRowInsert(&E.row[E.cy],E.cx,c);
-  E.cx++;
 }
-void editorInsertNewline(){
-  if(E.cx==0){
-    editorInsertRow(E.cy,"",0);
 
-  }else{
-    erow *row=&E.row[E.cy];
-    editorInsertRow(E.cy+1,&row->chars[E.cx],row->size-E.cx);
-    row=&E.row[E.cy];
-    row->size=E.cx;
-    row->chars[row->size]='\0';
-    editorUpdateRow(row);
-  }
-  E.cy++;
-  E.cx=0;
+/*** file i/o ***/
+const char *editorLazyLine(int line, int *len){
+  size_t from=lineStart(line);
+  const char *s=E.map+from;
+  size_t n=lineStart(line+1)-from;
+  while(n>0&&(s[n-1]=='\n'||s[n-1]=='\r'))n--;
+  *len=n;
+  return s;
 }
-void editorRowAppendString(erow *row, const std::string &s, size_t len){
-  row->chars.append(s,0,len);
-  row->size=row->chars.size();
-  editorUpdateRow(row);
-  E.dirty++;
+void editorLoadRow(erow *row, int line){
+  int len;
+  const char *s=editorLazyLine(line,&len);
+  row->size=len;
+  row->chars.point(s,len);//copied once the row is changed
+  row->hlgen=0;
 }
-void editorRowDelChar(erow *row, int at){
-  if(at<0 || at>= row->size) return;
-  memmove(&row->chars[at], &row->chars[at+1],row->size-at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+void editorUnmap(){
+  hlMarksCancel();
+  if(E.map)munmap((void*)E.map,E.mapsize);
+  E.map=NULL;
+  E.mapsize=0;
+  E.index.off.clear();
+  E.index.nl.clear();
+  E.index.lines=0;
 }
-void editorDelChar(){
-  if(E.cy==E.numrows) return;
-  if(E.cx==0 &&E.cy==9)return;
-  erow *row=&E.row[E.cy];
-  if(E.cx>0){
-    editorRowDelChar(row,E.cx-1);
-    E.cx--;
-  }else{
-  E.cx=E.row[E.cy-1].size;
-  editorRowAppendString(&E.row[E.cy-1],row->chars,row->size);
-  editorDelrow(E.cy);
-  E.cy--;}
+//clean rows are only a cache of the mapped file. once they take more than
+//their share of the budget, every run of them away from the screen that
+//still follows the file line by line goes back to being one lazy span.
+//edited rows hold the only copy of their text and always stay. the pages
+//of a paged file are let go every frame, what is on screen is in rows by now
+void editorTrimRows(){
+  editorPageOut(0,E.mapsize);
+  if(E.row.clean<=E.budget/4)return;
+  //a snapshot or a search may be reading the rows, and the matches on
+  //screen are only drawn while the text stays where it was
+  if(ropeShared||E.search.active||!E.search.workers.empty())return;
+  int lo=E.rowoff-E.screenrows,hi=E.rowoff+2*E.screenrows;
+  struct span { int at, lines, first; bool cached; };
+  std::vector<span> spans;
+  span cur={0,0,0,false};
+  E.row.forEachNode(0,E.numrows,[&](int at, rownode *t){
+    bool cached=t->first<0&&t->orig>=0&&!t->row.hl_job&&(at<lo||at>=hi);
+    int first=t->first>=0?t->first:cached?t->orig:-1;
+    if(first>=0&&cur.lines>0&&cur.first+cur.lines==first){
+      cur.lines+=t->lines;
+      cur.cached|=cached;
+      return true;
+    }
+    if(cur.cached)spans.push_back(cur);
+    cur={at,first>=0?t->lines:0,first,cached};
+    return true;
+  });
+  if(cur.cached)spans.push_back(cur);
+  for(size_t i=0;i<spans.size();i++)E.row.collapse(spans[i].at,spans[i].lines,spans[i].first);
+  E.edits++;//rows moved, pointers into them are stale
 }
-/*** file i/o ***/
-char* editorRowsToString(int *buflen){
-  int totlen=0;
-  int i;
-  for(i=0;i<E.numrows;i++)
-  totlen+=E.row[i].size+1;
-  *buflen=totlen;
-  char* buf=(char*)malloc(totlen);
-  char*p=buf;
-  for(i=0;i<E.numrows;i++){
-    memcpy(p,E.row[i].chars.c_str(),E.row[i].size);
-    p+=E.row[i].size;
-    *p='\n';
-    p++;
-  }
-  return buf;
+//the budget also caps the undo history
+void editorSetBudget(size_t bytes){
+  E.budget=bytes;
+  E.undo.max=std::min((size_t)KILO_UNDO_MAX,bytes/8);
+  //a match is kept by its unit and again in matches
+  E.search.max=std::min((size_t)KILO_SEARCH_MAX,bytes/8/(2*sizeof(searchmatch)));
+}
+//maps a regular file and puts all of its lines in the rope as one lazy span.
+//only the line index is built here, rows are read when they are first used
+int editorMapFile(int fd){
+  struct stat st;
+  if(fstat(fd,&st)==-1||!S_ISREG(st.st_mode)||st.st_size==0)return -1;
+  void *map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if(map==MAP_FAILED)return -1;
+  editorUnmap();
+  E.map=(const char*)map;
+  E.mapsize=st.st_size;
+  E.index.gen++;
+  E.index.paged=E.mapsize>E.budget;
+  editorIndexLines();
+  E.row.load(E.index.lines);
+  E.numrows=E.row.size();
+  E.hl_last_known=-1;
+  E.hl_marks.clear();
+  E.edits++;//pointers into the old map are stale
+  return 0;
 }
 void editorOpen(const char *filename) {
+  PROF_SCOPE(PROF_OPEN);
   free(E.filename);
   E.filename=strdup(filename);
   editorSelectSyntaxHighlight();
-  FILE *fp = fopen(filename, "r");
-  if (!fp) killswitch("fopen");
+  int fd=open(filename,O_RDONLY);
+  if(fd==-1) killswitch("open");
+  undoReset();
+  if(editorMapFile(fd)==0){
+    close(fd);
+    E.dirty=0;
+    return;
+  }
+  FILE *fp = fdopen(fd, "r");//not mappable (pipe, empty file...), read it line by line
+  if (!fp) killswitch("fdopen");
 
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
+  E.undo.replaying=true;//loading is not a change to undo
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
     while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
       linelen--;
     editorInsertRow(E.numrows ,line, linelen);
   }
+  E.undo.replaying=false;
   free(line);
   fclose(fp);
   E.dirty=0;
 }
+//collects what a save writes as iovecs and hands them to writev in batches.
+//pieces that follow each other in memory, like untouched lines of the mapped
+//file, become one iovec, so the text is never copied
+#define SAVE_IOV 1024
+#define SAVE_PROGRESS (8 << 20)//bytes between progress updates of a background save
+struct savebatch {
+  int fd;
+  struct iovec iov[SAVE_IOV];
+  int n;
+  size_t bytes;//written so far
+  bool failed;
+};
+void saveFlush(savebatch *b){
+  struct iovec *iov=b->iov;
+  int n=b->n;
+  while(n>0&&!b->failed){
+    PROF_COUNT(PROF_SYSCALLS,1);
+    ssize_t w=writev(b->fd,iov,n);
+    if(w==-1){
+      if(errno!=EINTR)b->failed=true;
+      continue;
+    }
+    b->bytes+=w;
+    while(n>0&&(size_t)w>=iov->iov_len){
+      w-=iov->iov_len;
+      iov++;
+      n--;
+    }
+    if(n>0){
+      iov->iov_base=(char*)iov->iov_base+w;
+      iov->iov_len-=w;
+    }
+  }
+  b->n=0;
+}
+void saveAppend(savebatch *b, const char *s, size_t len){
+  if(len==0)return;
+  if(b->n>0){
+    struct iovec *last=&b->iov[b->n-1];
+    if((const char*)last->iov_base+last->iov_len==s){
+      last->iov_len+=len;
+      return;
+    }
+  }
+  if(b->n==SAVE_IOV)saveFlush(b);
+  b->iov[b->n].iov_base=(void*)s;
+  b->iov[b->n++].iov_len=len;
+}
+//a save in progress. the rows are written from a snapshot of the rope on
+//a thread of their own, so editing goes on while a big file is saved
+struct editorSaveJob {
+  std::string filename;
+  rownode *root;//snapshot being written
+  int numrows;
+  bool crlf;
+  int dirty;//E.dirty when the snapshot was taken
+  std::atomic<int> rows_done;
+  std::atomic<bool> done;
+  ssize_t len;//result: bytes written or -1
+  int err;//result: errno when len is -1
+  double secs;
+  bool running;
+  std::thread thread;
+};
+editorSaveJob SJ;
+
+//writes rows [0,numrows) of the tree at root to fd, each ending in \n or \r\n,
+//counting finished rows in *done. returns the bytes written, or -1 on error
+ssize_t editorWriteRows(int fd, rownode *root, int numrows, bool crlf, std::atomic<int> *done){
+  const char *eol=crlf?"\r\n":"\n";
+  int eollen=crlf?2:1;
+  savebatch b;
+  b.fd=fd;
+  b.n=0;
+  b.bytes=0;
+  b.failed=false;
+  size_t pending=0;//bytes appended since the last progress update
+  size_t mapfrom=E.mapsize,mapto=0;//what of the map was written since then
+  ropeEachLine(root,0,numrows,[&](int at,const char *s,int len,erow *row){
+    //a line of the map that already ends the right way goes out as it is
+    if(!row&&s+len+eollen<=E.map+E.mapsize&&!memcmp(s+len,eol,eollen)){
+      saveAppend(&b,s,len+eollen);
+    }else{
+      saveAppend(&b,s,len);
+      saveAppend(&b,eol,eollen);
+    }
+    if(!row){
+      mapfrom=std::min(mapfrom,(size_t)(s-E.map));
+      mapto=std::max(mapto,(size_t)(s-E.map)+len);
+    }
+    pending+=len+eollen;
+    if(pending>=SAVE_PROGRESS){
+      saveFlush(&b);
+      editorPageOut(mapfrom,mapto);
+      mapfrom=E.mapsize;
+      mapto=0;
+      pending=0;
+      done->store(at+1,std::memory_order_relaxed);
+      editorWake();
+    }
+    return !b.failed;
+  });
+  saveFlush(&b);
+  return b.failed?-1:(ssize_t)b.bytes;
+}
+//saves through a temporary file next to the target that is synced and then
+//renamed over it, so a crash leaves either the old file or the new one
+void editorSaveFile(editorSaveJob *job){
+  PROF_SCOPE(PROF_SAVE_FILE);
+  struct timespec t0,t1;
+  clock_gettime(CLOCK_MONOTONIC,&t0);
+  //write through symlinks instead of replacing them
+  char *real=realpath(job->filename.c_str(),NULL);
+  std::string target=real?real:job->filename;
+  free(real);
+  size_t slash=target.rfind('/');
+  std::string dir=slash==std::string::npos?".":target.substr(0,slash+1);
+  std::string tmp=(slash==std::string::npos?"":dir)+"."+target.substr(slash+1)+".kilo-XXXXXX";
+
+  struct stat st;
+  bool existed=stat(target.c_str(),&st)==0;
+  if(!existed){
+    mode_t mask=umask(0);
+    umask(mask);
+    st.st_mode=0666&~mask;
+  }
+  ssize_t len=-1;
+  int fd=mkstemp(&tmp[0]);
+  if(fd!=-1){
+    if(existed&&fchown(fd,st.st_uid,st.st_gid)==-1){}//only root may give files away
+    if(fchmod(fd,st.st_mode&07777)==0)len=editorWriteRows(fd,job->root,job->numrows,job->crlf,&job->rows_done);
+    if(len!=-1&&fsync(fd)==-1)len=-1;
+    if(close(fd)==-1)len=-1;
+    if(len!=-1&&rename(tmp.c_str(),target.c_str())==-1)len=-1;
+    if(len==-1){
+      int err=errno;
+      unlink(tmp.c_str());
+      errno=err;
+    }
+  }
+  job->err=errno;
+  if(len!=-1){
+    //make the rename itself durable
+    int dfd=open(dir.c_str(),O_RDONLY);
+    if(dfd!=-1){
+      fsync(dfd);
+      close(dfd);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  job->secs=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+  job->len=len;
+  job->rows_done.store(job->numrows,std::memory_order_relaxed);
+  job->done.store(true,std::memory_order_release);
+  editorWake();
+}
+//finishes the save once its thread is done, otherwise shows how far it got.
+//wait blocks until it is done
+void editorSaveCollect(bool wait){
+  if(!SJ.running)return;
+  if(!wait&&!SJ.done.load(std::memory_order_acquire)){
+    int pct=SJ.numrows?(int)(100.0*SJ.rows_done.load(std::memory_order_relaxed)/SJ.numrows):0;
+    editorStatusMessage("saving %s... %d%%",SJ.filename.c_str(),pct);
+    return;
+  }
+  SJ.thread.join();
+  SJ.running=false;
+  //the prompt may be open with workers reading the rows and the map that
+  //are about to go. the search is planned again on the next key
+  searchStop();
+  E.search.valid=false;
+  ropeRelease();
+  if(SJ.len==-1){
+    editorStatusMessage("can't save! I/O error: %s",strerror(SJ.err));
+    return;
+  }
+  //changes made while saving are still unsaved
+  E.dirty-=SJ.dirty;
+  //the old mapping still shows the replaced file and stays valid, but
+  //mapping the new one lets that file go and drops the loaded rows. only
+  //when the rows are exactly what was written
+  if(E.map&&E.dirty==0){
+    int fd=open(SJ.filename.c_str(),O_RDONLY);
+    if(fd!=-1){
+      editorMapFile(fd);
+      close(fd);
+    }
+  }
+  editorStatusMessage("%zd bytes written to disk (%.1f MB/s)",SJ.len,SJ.secs>0?SJ.len/SJ.secs/1e6:0.0);
+}
 void editorSave(){
+  PROF_SCOPE(PROF_SAVE);
+  if(SJ.running){
+    editorStatusMessage("a save is already running");
+    return;
+  }
   if(E.filename==NULL){
     E.filename=editorPrompt("save as: %s (ESC to cancel)",NULL);
     if(E.filename==NULL){
@@ -465,77 +3778,383 @@ void editorSave(){
     }
     editorSelectSyntaxHighlight();
   }
-  int len;
-  char *buf=editorRowsToString(&len);
-  int fd=open(E.filename,O_RDWR |O_CREAT,0644);
-  //O_CREAT: create a new file,, RDWR: read&write..0644:standard perm. for text file
-  
-  if(fd!=-1){
-    if(ftruncate(fd,len)!=1){//ftruncate:set file size to specified length
-      if(write(fd,buf,len)==len){
-        close(fd);
-        free(buf);
-        E.dirty=0;
-        editorStatusMessage("%d bytes written to disk",len);
-        return;
+  SJ.filename=E.filename;
+  SJ.root=E.row.snapshot();
+  SJ.numrows=E.numrows;
+  SJ.crlf=E.crlf;
+  SJ.dirty=E.dirty;
+  SJ.rows_done.store(0,std::memory_order_relaxed);
+  SJ.done.store(false,std::memory_order_relaxed);
+  SJ.running=true;
+  //editorWake brings the main loop back to show progress and finish up
+  SJ.thread=std::thread(editorSaveFile,&SJ);
+  editorSaveCollect(false);
+}
+/** search engine **/
+//each scanner appends the offset of every occurrence of q in s[from,n) to out,
+//overlapping ones included. a position is only compared in full once it
+//matches both the first and the last byte of q
+void searchScalar(const char *s, size_t from, size_t n, const char *q, size_t m, std::vector<size_t> &out){
+  if(n<m||from>n-m)return;
+  const char *p=s+from,*end=s+n-m+1;
+  while(p<end&&(p=(const char*)memchr(p,q[0],end-p))!=NULL){
+    if(p[m-1]==q[m-1]&&!memcmp(p,q,m))out.push_back(p-s);
+    p++;
+  }
+}
+#if defined(__SSE2__)
+void searchSSE2(const char *s, size_t n, const char *q, size_t m, std::vector<size_t> &out){
+  const __m128i first=_mm_set1_epi8(q[0]),last=_mm_set1_epi8(q[m-1]);
+  size_t i=0;
+  for(;i+m-1+16<=n;i+=16){
+    __m128i a=_mm_loadu_si128((const __m128i*)(s+i));
+    __m128i b=_mm_loadu_si128((const __m128i*)(s+i+m-1));
+    unsigned mask=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,first),_mm_cmpeq_epi8(b,last)));
+    while(mask){
+      size_t at=i+__builtin_ctz(mask);
+      if(!memcmp(s+at,q,m))out.push_back(at);
+      mask&=mask-1;
+    }
+  }
+  searchScalar(s,i,n,q,m,out);
+}
+#endif
+#ifdef KILO_HAVE_AVX2
+__attribute__((target("avx2")))
+void searchAVX2(const char *s, size_t n, const char *q, size_t m, std::vector<size_t> &out){
+  const __m256i first=_mm256_set1_epi8(q[0]),last=_mm256_set1_epi8(q[m-1]);
+  size_t i=0;
+  for(;i+m-1+32<=n;i+=32){
+    __m256i a=_mm256_loadu_si256((const __m256i*)(s+i));
+    __m256i b=_mm256_loadu_si256((const __m256i*)(s+i+m-1));
+    unsigned mask=_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a,first),_mm256_cmpeq_epi8(b,last)));
+    while(mask){
+      size_t at=i+__builtin_ctz(mask);
+      if(!memcmp(s+at,q,m))out.push_back(at);
+      mask&=mask-1;
+    }
+  }
+  searchScalar(s,i,n,q,m,out);
+}
+#endif
+void searchPlain(const char *s, size_t n, const char *q, size_t m, std::vector<size_t> &out){
+  searchScalar(s,0,n,q,m,out);
+}
+typedef void (*searchScanner)(const char*, size_t, const char*, size_t, std::vector<size_t>&);
+searchScanner searchPickScanner(){
+#ifdef KILO_HAVE_AVX2
+  if(__builtin_cpu_supports("avx2"))return searchAVX2;
+#endif
+#if defined(__SSE2__)
+  return searchSSE2;
+#else
+  return searchPlain;
+#endif
+}
+bool searchBefore(const searchmatch &a, const searchmatch &b){
+  return a.row<b.row||(a.row==b.row&&a.col<b.col);
+}
+//index in E.search.matches of the first match at or after (row,col)
+int editorSearchFrom(int row, int col){
+  std::vector<searchmatch> &v=E.search.matches;
+  searchmatch key={row,col,0};
+  return std::lower_bound(v.begin(),v.end(),key,searchBefore)-v.begin();
+}
+//cuts the text into pieces and groups them into units. lazy spans are cut
+//at line boundaries so no piece is much over KILO_SEARCH_CHUNK bytes
+void searchPlan(){
+  editorSearch &S=E.search;
+  for(size_t i=0;i<S.units.size();i++)delete S.units[i];
+  S.units.clear();
+  S.pieces.clear();
+  E.row.forEachNode(0,E.numrows,[&](int at, rownode *t){
+    if(t->first<0){
+      S.pieces.push_back({at,1,-1,t->row.chars.data(),(size_t)t->row.size});
+      return true;
+    }
+    int end=t->first+t->lines;
+    size_t from=lineStart(t->first);
+    for(int l=t->first;l<end;){
+      int e=lineAt(from+KILO_SEARCH_CHUNK,l+1,end+1);
+      if(e<l+1)e=l+1;
+      size_t to=lineStart(e);
+      S.pieces.push_back({at+l-t->first,e-l,l,E.map+from,to-from});
+      l=e;
+      from=to;
+    }
+    return true;
+  });
+  size_t bytes=0;
+  int lo=0;
+  for(int p=0;p<(int)S.pieces.size();p++){
+    bytes+=S.pieces[p].len+64;//rows are cheap to scan, but not free
+    if(bytes<KILO_SEARCH_CHUNK&&p+1<(int)S.pieces.size())continue;
+    searchunit *u=new searchunit();
+    u->lo=lo;
+    u->hi=p+1;
+    u->narrow=false;
+    u->done.store(false,std::memory_order_relaxed);
+    S.units.push_back(u);
+    lo=p+1;
+    bytes=0;
+  }
+  editorPageOut(0,E.mapsize);
+}
+//finds every match of q in unit u. returns false if the search was cancelled,
+//and leaves u->query empty if it gave up because too many matches are kept
+bool searchScanUnit(searchunit *u, const char *q, size_t m, std::vector<size_t> &hits){
+  static searchScanner scan=searchPickScanner();
+  editorSearch &S=E.search;
+  u->query.clear();
+  u->hits.clear();
+  for(int p=u->lo;p<u->hi;p++){
+    if(S.cancel.load(std::memory_order_relaxed))return false;
+    if(S.stored.load(std::memory_order_relaxed)>S.max)return true;
+    searchpiece &pc=S.pieces[p];
+    hits.clear();
+    scan(pc.s,pc.len,q,m,hits);
+    if(S.stored.fetch_add(hits.size())+hits.size()>S.max)return true;
+    if(pc.first<0){
+      for(size_t i=0;i<hits.size();i++)u->hits.push_back({pc.at,(int)hits[i],(int)m});
+      continue;
+    }
+    //the query has no newline in it, so a hit never runs from one line into
+    //the next. hits come in order, so lines are counted on from the last one
+    const char *start=pc.s;
+    int l=pc.first;
+    for(size_t i=0;i<hits.size();i++){
+      const char *at=pc.s+hits[i],*nl;
+      while((nl=(const char*)memchr(start,'\n',at-start))!=NULL){
+        start=nl+1;
+        l++;
       }
+      u->hits.push_back({pc.at+l-pc.first,(int)(at-start),(int)m});
     }
-    close(fd);
+    size_t base=pc.s-E.map;
+    editorPageOut(base,base+pc.len);
+  }
+  u->query=S.query;
+  return true;
+}
+//keeps the hits of u that still match now that the query grew. a match of
+//the longer query is always a match of its prefix, so nothing is rescanned
+bool searchNarrowUnit(searchunit *u, const char *q, size_t m){
+  editorSearch &S=E.search;
+  std::vector<searchmatch> kept;
+  int p=u->lo;
+  for(size_t i=0;i<u->hits.size();i++){
+    if((i&4095)==0&&S.cancel.load(std::memory_order_relaxed))return false;
+    searchmatch h=u->hits[i];
+    while(h.row>=S.pieces[p].at+S.pieces[p].lines)p++;
+    searchpiece &pc=S.pieces[p];
+    const char *s=pc.s;
+    int len=pc.len;
+    if(pc.first>=0)s=editorLazyLine(pc.first+h.row-pc.at,&len);
+    h.len=m;
+    if(len-h.col>=(int)m&&!memcmp(s+h.col,q,m))kept.push_back(h);
+  }
+  u->hits.swap(kept);
+  S.stored.fetch_add(u->hits.size());
+  u->query=S.query;
+  return true;
+}
+//searchScanUnit for a regex. only lines holding the pattern's required
+//literal are run through the matcher
+bool searchRegexUnit(searchunit *u, rematcher *rm){
+  editorSearch &S=E.search;
+  const std::string &lit=S.re->literal;
+  u->query.clear();
+  u->hits.clear();
+  for(int p=u->lo;p<u->hi;p++){
+    if(S.cancel.load(std::memory_order_relaxed))return false;
+    if(S.stored.load(std::memory_order_relaxed)>S.max)return true;
+    searchpiece &pc=S.pieces[p];
+    size_t before=u->hits.size();
+    int row;
+    auto found=[&](int col, int len){ u->hits.push_back({row,col,len}); };
+    if(pc.first<0){
+      row=pc.at;
+      if(lit.empty()||memmem(pc.s,pc.len,lit.data(),lit.size()))reEachMatch(rm,pc.s,pc.len,found);
+    }else if(lit.empty()){
+      for(int l=0;l<pc.lines;l++){
+        int len;
+        const char *s=editorLazyLine(pc.first+l,&len);
+        row=pc.at+l;
+        reEachMatch(rm,s,len,found);
+      }
+    }else{
+      //find the literal, match its line, and look again from the next line.
+      //lines are counted on from the last one matched
+      int l=pc.first;
+      const char *at=pc.s,*start=pc.s,*stop=pc.s+pc.len,*nl;
+      while((at=(const char*)memmem(at,stop-at,lit.data(),lit.size()))!=NULL){
+        while((nl=(const char*)memchr(start,'\n',at-start))!=NULL){
+          start=nl+1;
+          l++;
+        }
+        int len;
+        const char *s=editorLazyLine(l,&len);
+        row=pc.at+l-pc.first;
+        reEachMatch(rm,s,len,found);
+        at=start=E.map+lineStart(++l);
+      }
+    }
+    if(pc.first>=0)editorPageOut(pc.s-E.map,pc.s-E.map+pc.len);
+    size_t added=u->hits.size()-before;
+    if(S.stored.fetch_add(added)+added>S.max)return true;
+  }
+  u->query=S.query;
+  return true;
+}
+//takes units until there are none left or the search is cancelled
+void searchWorker(){
+  editorSearch &S=E.search;
+  std::vector<size_t> hits;
+  const char *q=S.query.data();
+  size_t m=S.query.size();
+  rematcher rm;
+  if(S.regex)reMatcherInit(&rm,S.re);
+  while(!S.cancel.load(std::memory_order_relaxed)){
+    size_t i=S.next.fetch_add(1);
+    if(i>=S.units.size())break;
+    searchunit *u=S.units[i];
+    if(u->done.load(std::memory_order_relaxed))continue;
+    bool ok;
+    if(S.regex)ok=searchRegexUnit(u,&rm);
+    else if(u->narrow)ok=searchNarrowUnit(u,q,m);
+    else ok=searchScanUnit(u,q,m,hits);
+    if(ok){
+      u->regex=S.regex;
+      u->done.store(true,std::memory_order_release);
+      editorWake();//turns into a REDRAW_KEY
+    }
+  }
+  if(S.regex)reMatcherFree(&rm);
+}
+//stops the workers, leaving finished units finished and the rest to redo
+void searchStop(){
+  editorSearch &S=E.search;
+  if(S.workers.empty())return;
+  S.cancel.store(true);
+  for(size_t i=0;i<S.workers.size();i++)S.workers[i].join();
+  S.workers.clear();
+  S.cancel.store(false);
+  if(S.merged<S.units.size()&&!S.truncated)S.valid=false;
+}
+//lets the workers run to the end of the search instead of cancelling it
+void searchWait(){
+  editorSearch &S=E.search;
+  for(size_t i=0;i<S.workers.size();i++)S.workers[i].join();
+  S.workers.clear();
+}
+//moves the hits of units finished in order into matches, up to the first
+//unit that gave up. returns whether nothing more will come
+bool searchCollect(){
+  editorSearch &S=E.search;
+  while(!S.truncated&&S.merged<S.units.size()&&
+        S.units[S.merged]->done.load(std::memory_order_acquire)){
+    searchunit *u=S.units[S.merged];
+    if(u->query.empty()){
+      S.truncated=true;
+      break;
+    }
+    S.matches.insert(S.matches.end(),u->hits.begin(),u->hits.end());
+    S.merged++;
+  }
+  bool finished=S.truncated||S.merged==S.units.size();
+  if(finished&&!S.workers.empty()){
+    for(size_t i=0;i<S.workers.size();i++)S.workers[i].join();
+    S.workers.clear();
+  }
+  return finished;
+}
+//starts searching for query unless that search is already running or done.
+//units that hold the complete hits of a prefix of a literal query are only
+//narrowed
+void editorSearchStart(const char *query, bool regex){
+  editorSearch &S=E.search;
+  if(S.valid&&S.edits==E.edits&&S.query==query&&S.regex==regex)return;
+  searchStop();
+  if(!S.valid||S.edits!=E.edits){
+    searchPlan();
+    S.edits=E.edits;
   }
-  free(buf);
-  editorStatusMessage("can't save! I/O error: %s",strerror(errno));
+  S.valid=true;
+  S.query=query;
+  S.regex=regex;
+  S.current=-1;
+  S.matches.clear();
+  S.merged=0;
+  S.truncated=false;
+  S.stored.store(0);
+  if(regex&&!S.re)S.re=new reprog();
+  //a pattern that does not compile finds nothing, the status bar shows why
+  if(S.query.empty()||(regex&&!reCompile(S.re,S.query))){
+    S.merged=S.units.size();
+    return;
+  }
+  for(size_t i=0;i<S.units.size();i++){
+    searchunit *u=S.units[i];
+    bool same=!u->query.empty()&&u->query==S.query&&u->regex==regex;
+    u->narrow=!regex&&!u->query.empty()&&!u->regex&&
+      S.query.compare(0,u->query.size(),u->query)==0;
+    u->done.store(same,std::memory_order_relaxed);
+    if(same)S.stored.fetch_add(u->hits.size());
+  }
+  S.next.store(0);
+  size_t nthreads=std::thread::hardware_concurrency();
+  if(nthreads==0)nthreads=1;
+  if(nthreads>S.units.size())nthreads=S.units.size();
+  for(size_t i=0;i<nthreads;i++)S.workers.push_back(std::thread(searchWorker));
+  if(!E.search_async)searchWait();
 }
+
 /** find **/
 void editorFindCallBack(char* query, int key){
-  static int last_match=-1;
-  static int direction=1;
-  static int saved_hl_line;
-  static char *saved_hl=NULL;
-  if(saved_hl){
-    memcpy(E.row[saved_hl_line].hl,saved_hl,E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl=NULL;
-  }
-  if(key=='\r'|| key=='\x1b'){
-    last_match=-1;
-    direction=1;
+  PROF_SCOPE(PROF_FIND);
+  editorSearch &S=E.search;
+  if(key=='\x1b'){
+    searchStop();
+    S.active=false;
     return;
   }
-  else if(key==ARROW_RIGHT||key==ARROW_DOWN){
-    direction=1;
+  S.active=true;
+  editorSearchStart(query,key==CTRL_KEY('r')?!S.regex:S.regex);
+  //enter lands on a match of the whole query, not of a prefix still on screen
+  if(key=='\r')searchWait();
+  bool finished=searchCollect();
+  bool wrap=finished&&!S.truncated;
+  int n=S.matches.size();
+  int to=S.current;
+  if(S.current<0){
+    //a new query starts from the first match at or after where the search
+    //began, which is known once the scan got past it
+    to=editorSearchFrom(S.origin_row,S.origin_col);
+    if(to==n)to=wrap&&n?0:-1;
+  }else if(key==ARROW_RIGHT||key==ARROW_DOWN){
+    if(S.current+1<n)to=S.current+1;
+    else if(wrap)to=0;
   }else if(key==ARROW_LEFT||key==ARROW_UP){
-    direction=-1;
-  }else{
-    last_match=-1;
-    direction=1;
-  }
-  if(last_match==-1)direction=1;
-  int current=last_match;
-  for(int i=0;i<E.numrows;i++){
-    current+=direction;
-    if(current==-1)current=E.numrows-1;
-    else if(current==E.numrows)current=0;
-    erow *row=&E.row[current];
-    const char *match=strstr(row->render.c_str(),query);
-    if(match){
-      last_match=current;
-      E.cy=current;
-      E.cx=editorRowRxToCx(row,match-row->render.c_str());
-      E.rowoff=E.numrows;
-      saved_hl_line=current;
-      saved_hl=(char*)malloc(row->size);
-      memset(&row->hl[match - row->render.c_str()],HL_MATCH,strlen(query));
-      break;
-    }
+    if(S.current>0)to=S.current-1;
+    else if(wrap)to=n-1;
   }
+  if(key=='\r')S.active=false;
+  if(to<0||to==S.current)return;
+  S.current=to;
+  E.cy=S.matches[to].row;
+  E.cx=S.matches[to].col;
+  E.rowoff=E.numrows;
 }
 void editorFind(){
   int saved_cx=E.cx;
   int saved_cy=E.cy;
   int saved_coloff=E.coloff;
   int saved_rowoff=E.rowoff;
+  E.search.origin_row=E.cy;
+  E.search.origin_col=E.cx;
+  E.search.current=-1;
 
-  char *query = editorPrompt("Search: &s (use ESC/Arrows/Enter)",editorFindCallBack);
+  char *query = editorPrompt("Search: %s (use ESC/Arrows/Enter, Ctrl-R: regex)",editorFindCallBack);
   if(query){free(query);}
   else{
     E.cx=saved_cx;
@@ -549,22 +4168,40 @@ void editorFind(){
 struct abuf {
   char *b;
   int len;
+  int cap;
 
-  abuf() : b(nullptr), len(0) {}
+  abuf() : b(nullptr), len(0), cap(0) {}
   ~abuf() {
     delete[] b;
   }
 
-  void append(const char *s, int new_len) {
-    char *newbuf = new char[len + new_len];
+  //makes room for n more bytes. capacity doubles and never shrinks, so a
+  //buffer that is reused for every frame stops allocating once it fits one
+  void reserve(int n) {
+    if (len + n <= cap) return;
+    int newcap = cap ? cap : 4096;
+    while (newcap < len + n) newcap *= 2;
+    char *newbuf = new char[newcap];
+    PROF_COUNT(PROF_ALLOCS,1);
     if (b) {
       memcpy(newbuf, b, len);
       delete[] b;
     }
-    memcpy(newbuf + len, s, new_len);
     b = newbuf;
+    cap = newcap;
+  }
+  void append(const char *s, int new_len) {
+    reserve(new_len);
+    memcpy(b + len, s, new_len);
     len += new_len;
   }
+  //hands out n bytes at the end of the buffer for the caller to fill
+  char *extend(int n) {
+    reserve(n);
+    len += n;
+    return b + len - n;
+  }
+  void clear() { len = 0; }
 };
 
 void abAppend(abuf *ab, const char *s, int len) {
@@ -575,13 +4212,19 @@ void abFree(abuf *ab) {
   delete[] ab->b;
   ab->b = nullptr;
   ab->len = 0;
+  ab->cap = 0;
 }
 
 /*** output ***/
 void editorScroll() { // to set the E.rowoff value
   E.rx=0;
   if(E.cy<E.numrows){
-    E.rx=editorRowCxtoRx(&E.row[E.cy],E.cx);
+    erow *row=&E.row[E.cy];
+    //page keys and undo can leave the cursor past the end of a shorter row
+    if(E.cx>row->size)E.cx=row->size;
+    E.rx=editorRowCxtoRx(row,E.cx);
+  }else{
+    E.cx=0;//the line past the last row is empty
   }
   if (E.cy < E.rowoff) { // check if cursor above window
     E.rowoff = E.cy;
@@ -596,7 +4239,153 @@ void editorScroll() { // to set the E.rowoff value
     E.coloff = E.rx - E.screencols + 1;
   }
 }
+void screenBegin(abuf *ab){
+  editorScreen &S=E.screen;
+  int rows=E.screenrows+2,cols=E.screencols;
+  if(S.rows!=rows||S.cols!=cols){
+    S.rows=rows;
+    S.cols=cols;
+    S.valid=false;
+  }
+  scell blank={' ',0};
+  if(!S.valid){
+    abAppend(ab,"\x1b[m\x1b[2J",7);
+    S.shown.assign(rows*cols,blank);
+    S.attr=0;
+    S.valid=true;
+    S.rowoff=E.rowoff;
+    S.coloff=E.coloff;
+  }
+  S.next.assign(rows*cols,blank);
+}
+void screenPut(int y, int x, const char *s, int len, int attr){
+  editorScreen &S=E.screen;
+  if(x+len>S.cols)len=S.cols-x;
+  scell *line=&S.next[y*S.cols];
+  for(int j=0;j<len;j++){
+    line[x+j].ch=s[j];
+    line[x+j].attr=attr;
+  }
+}
+void screenSetAttr(abuf *ab, int attr){
+  editorScreen &S=E.screen;
+  if(attr==S.attr)return;
+  char buf[16];
+  int clen;
+  int color=attr&~ATTR_INVERSE;
+  if((S.attr&ATTR_INVERSE)&&!(attr&ATTR_INVERSE)){
+    //leaving inverse video needs a full reset, the color is set again after it
+    abAppend(ab,"\x1b[m",3);
+    S.attr=0;
+  }
+  if((attr&ATTR_INVERSE)&&!(S.attr&ATTR_INVERSE))abAppend(ab,"\x1b[7m",4);
+  if(color!=(S.attr&~ATTR_INVERSE)){
+    clen=snprintf(buf,sizeof(buf),"\x1b[%dm",color?color:39);
+    abAppend(ab,buf,clen);
+  }
+  S.attr=attr;
+}
+//when the view moved by fewer lines than it shows, scrolls the text lines
+//on the terminal with a scroll region, so the diff only finds the lines
+//that came into view. the status and message bars are outside the region
+void screenScroll(abuf *ab){
+  editorScreen &S=E.screen;
+  int rows=E.screenrows,d=E.rowoff-S.rowoff;
+  int n=d<0?-d:d;
+  if(n==0||n>=rows||E.coloff!=S.coloff){
+    S.rowoff=E.rowoff;
+    S.coloff=E.coloff;
+    return;
+  }
+  screenSetAttr(ab,0);//lines scrolled in take the current background
+  char buf[32];
+  int clen=snprintf(buf,sizeof(buf),"\x1b[1;%dr\x1b[%d%c\x1b[r",rows,n,d>0?'S':'T');
+  abAppend(ab,buf,clen);
+  scell blank={' ',0};
+  scell *text=&S.shown[0];
+  int keep=(rows-n)*S.cols;
+  if(d>0){
+    memmove(text,text+n*S.cols,keep*sizeof(scell));
+    std::fill(text+keep,text+rows*S.cols,blank);
+  }else{
+    memmove(text+n*S.cols,text,keep*sizeof(scell));
+    std::fill(text,text+n*S.cols,blank);
+  }
+  S.rowoff=E.rowoff;
+}
+int scellSame(scell a, scell b){
+  return a.ch==b.ch&&a.attr==b.attr;
+}
+//sends the part of screen line y that changed since the last frame
+void screenFlushLine(abuf *ab, int y){
+  editorScreen &S=E.screen;
+  scell *old=&S.shown[y*S.cols];
+  scell *cur=&S.next[y*S.cols];
+  int first=0,last=S.cols-1;
+  while(first<S.cols&&scellSame(old[first],cur[first]))first++;
+  if(first==S.cols)return;
+  while(scellSame(old[last],cur[last]))last--;
+  //columns are counted in bytes, so a line with multibyte characters is
+  //sent whole rather than starting a span in the middle of a character
+  for(int x=0;x<S.cols;x++){
+    if((unsigned char)old[x].ch>=0x80||(unsigned char)cur[x].ch>=0x80){
+      first=0;
+      last=S.cols-1;
+      break;
+    }
+  }
+  int end=S.cols;//past the last cell that is not a plain blank
+  while(end>0&&cur[end-1].ch==' '&&cur[end-1].attr==0)end--;
+
+  char buf[32];
+  int clen=snprintf(buf,sizeof(buf),"\x1b[%d;%dH",y+1,first+1);
+  abAppend(ab,buf,clen);
+  int stop=last<end?last+1:end;
+  for(int x=first;x<stop;){
+    //one attribute change and one append per run of same-colored cells
+    int run=x;
+    while(run<stop&&cur[run].attr==cur[x].attr)run++;
+    screenSetAttr(ab,cur[x].attr);
+    char *out=ab->extend(run-x);
+    for(;x<run;x++)*out++=cur[x].ch;
+  }
+  if(last>=end){//the rest of the line is blank, erase it instead of sending spaces
+    screenSetAttr(ab,0);
+    abAppend(ab,"\x1b[K",3);
+  }
+  memcpy(old,cur,S.cols*sizeof(scell));
+}
+//paints the search matches of row filerow over screen line y, the one the
+//cursor is on in inverse
+void editorDrawMatches(int y, erow *row, int filerow){
+  editorSearch &S=E.search;
+  for(int i=editorSearchFrom(filerow,0);i<(int)S.matches.size()&&S.matches[i].row==filerow;i++){
+    int from=editorRowCxtoRx(row,S.matches[i].col)-E.coloff;
+    int to=editorRowCxtoRx(row,S.matches[i].col+S.matches[i].len)-E.coloff;
+    if(from<0)from=0;
+    if(to>E.screencols)to=E.screencols;
+    int attr=editorSyntaxToColor(HL_MATCH)|(i==S.current?ATTR_INVERSE:0);
+    int rx0=row->cols?row->cols->rx0:0;//long rows only have a slice rendered
+    if(from<to)screenPut(y,from,editorRowRender(row)+E.coloff-rx0+from,to-from,attr);
+  }
+}
 void editorDrawRows(abuf *ab) {
+  PROF_SCOPE(PROF_DRAW_ROWS);
+  //fetch the visible rows with one in-order walk instead of a lookup per line
+  std::vector<erow*> visible;
+  E.row.forEach(E.rowoff,E.rowoff+E.screenrows,[&](int,erow &row){
+    visible.push_back(&row);
+    return true;
+  });
+  hlMarksCollect();
+  int state=editorSyntaxStartState(E.rowoff);
+  if(state<0){
+    //drawn plain until the worker has lexed down to here, then redrawn
+    hlMarksPost(E.rowoff);
+    state=editorSyntaxStartState(E.rowoff);
+  }
+  H.view_lo.store(E.rowoff,std::memory_order_relaxed);
+  H.view_hi.store(E.rowoff+E.screenrows,std::memory_order_relaxed);
   int y;
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff; // to display each y position
@@ -607,97 +4396,130 @@ void editorDrawRows(abuf *ab) {
           "Kilo editor -- version %s", KILO_VERSION);
         if (welcomelen > E.screencols) welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        if (padding) screenPut(y,0,"~",1,0);
+        screenPut(y,padding,welcome,welcomelen,0);
       } else {
-        abAppend(ab, "~", 1);
+        screenPut(y,0,"~",1,0);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row=visible[filerow-E.rowoff];
+      bool ready=false;//plain until highlighted
+      if(state>=0){
+        ready=editorRowHighlight(row,filerow,state);
+        state=editorRowEndState(row,filerow,state);
+      }else{
+        editorRowPlain(row);
+      }
+      int rx0=row->cols?row->cols->rx0:0;//long rows only have a slice rendered
+      int len = rx0 + row->rsize - E.coloff;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      char *c=&E.row[filerow].render[E.coloff];
-      unsigned char *hl=&E.row[filerow].hl[E.coloff];
-      int current_color=-1;
-      int j;
-      for(j=0;j<len;j++){
-        if(hl[j]==HL_NORMAL){
-          if(current_color!=-1){
-          abAppend(ab,"\x1b[39m",5);//39m:reset color
-          current_color=-1;
-          }
-          abAppend(ab,&c[j],1);
-        }else{
-          int color=editorSyntaxToColor(hl[j]);
-          if(color!=current_color){
-            current_color=color;
-          char buf[16];
-          int clen=snprintf(buf,sizeof(buf),"\x1b[%dm",color);
-          abAppend(ab,buf,clen);
-          }
-          abAppend(ab,&c[j],1);
-        }
+      const char *c=editorRowRender(row)+E.coloff-rx0;
+      screenPut(y,0,c,len,0);
+      hlspan *sp=ready?editorRowSpans(row):NULL,*end=sp+(ready?row->nhl:0);
+      sp=std::lower_bound(sp,end,E.coloff-rx0,[](const hlspan &a, int x){ return a.start+a.len<=x; });
+      for(;sp<end&&sp->start<E.coloff-rx0+len;sp++){//spans over the plain text
+        int from=std::max(sp->start-(E.coloff-rx0),0);
+        int to=std::min(sp->start+sp->len-(E.coloff-rx0),len);
+        screenPut(y,from,c+from,to-from,editorSyntaxToColor(sp->hl));
       }
-          abAppend(ab,"\x1b[39m",5);//31m is red
-        }
-    abAppend(ab, "\x1b[K", 3);
-    if(y<E.screenrows-1)
-      abAppend(ab, "\r\n", 2);
-    
+      if(E.search.active&&E.search.edits==E.edits)editorDrawMatches(y,row,filerow);
+    }
+    screenFlushLine(ab,y);
   }
+  hlSweep();
 }
 void editorStatusBar(struct abuf *ab){
-  abAppend(ab,"\x1b[7m",4);//color inversion
-  char status[80],rstatus[80];
+  int y=E.screenrows;
+  char status[80],rstatus[80],match[64]="";
+  if(E.search.active&&E.search.query.size()){
+    int n=E.search.matches.size();
+    //gave up after E.search.max matches, or still scanning
+    const char *more=E.search.truncated?" (truncated)":E.search.merged<E.search.units.size()?"+":"";
+    const char *mode=E.search.regex?"regex ":"";
+    if(E.search.regex&&!E.search.re->error.empty())
+      snprintf(match,sizeof(match),"regex: %.40s | ",E.search.re->error.c_str());
+    else if(E.search.current<0)snprintf(match,sizeof(match),"%s%d%s matches | ",mode,n,more);
+    else snprintf(match,sizeof(match),"%smatch %d of %d%s | ",mode,E.search.current+1,n,more);
+  }
   int len=snprintf(status,sizeof(status),"%.20s- %d lines %s",
   E.filename?E.filename:"[No Name]",E.numrows,
   E.dirty ?"(modified)": "");
-  int rlen=snprintf(rstatus,sizeof(rstatus),"%s | %d/%d",
-    E.syntax?E.syntax->filetype: "no ft",E.cy+1,E.numrows);
+#ifndef KILO_NO_PROFILE
+  if(P.on.load(std::memory_order_relaxed))len=profOverlay(status,sizeof(status));
+#endif
+  int rlen=snprintf(rstatus,sizeof(rstatus),"%s%s%s | %d/%d",match,
+    E.syntax?E.syntax->filetype: "no ft",E.crlf?" | CRLF":"",E.cy+1,E.numrows);
   if(len>E.screencols)len=E.screencols;//ensure bar doesnt exceed screen width
-  abAppend(ab,status,len);
-  while(len<E.screencols){
-    if(E.screencols-len==rlen){
-      abAppend(ab,rstatus,rlen);
-      break;
-    }else{
-    abAppend(ab," ",1);
-    len++;
-  }
-  }
-  abAppend(ab,"\x1b[m",3);
-  abAppend(ab,"\r\n",2);
-
+  for(int x=0;x<E.screencols;x++)screenPut(y,x," ",1,ATTR_INVERSE);//color inversion
+  screenPut(y,0,status,len,ATTR_INVERSE);
+  if(E.screencols-len>=rlen)screenPut(y,E.screencols-rlen,rstatus,rlen,ATTR_INVERSE);
+  screenFlushLine(ab,y);
 }
 void editorMessageBar(struct abuf *ab){
-  abAppend(ab,"\x1b[K",3);
+  int y=E.screenrows+1;
   int msglen=strlen(E.statusmsg);
   if(msglen>E.screencols)msglen=E.screencols;
-  if(msglen && time(NULL)- E.statusmsg_time<5)
-  abAppend(ab,E.statusmsg,msglen);
+  if(msglen && time(NULL)- E.statusmsg_time<KILO_MSG_SECS)
+  screenPut(y,0,E.statusmsg,msglen,0);
+  screenFlushLine(ab,y);
+}
+//writes all of iov, picking up where a short write stopped
+void editorWritev(struct iovec *iov, int iovcnt){
+  if(T.replay){
+    for(int i=0;i<iovcnt;i++)T.bytes_out+=iov[i].iov_len;
+    return;
+  }
+  while(iovcnt>0){
+    PROF_COUNT(PROF_SYSCALLS,1);
+    ssize_t n=writev(STDOUT_FILENO,iov,iovcnt);
+    if(n==-1){
+      if(errno==EINTR||errno==EAGAIN)continue;
+      return;
+    }
+    while(iovcnt>0&&(size_t)n>=iov->iov_len){
+      n-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt>0){
+      iov->iov_base=(char*)iov->iov_base+n;
+      iov->iov_len-=n;
+    }
+  }
 }
 void editorRefreshScreen() {
+  PROF_SCOPE(PROF_REFRESH);
+  static abuf frame;//kept across frames so its storage is reused
+  editorSaveCollect(false);
   editorScroll();
-  abuf ab;
+  editorTrimRows();
+  frame.clear();
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
-  editorDrawRows(&ab);
-  editorStatusBar(&ab);
-  editorMessageBar(&ab);
-
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  screenBegin(&frame);
+  screenScroll(&frame);
+  editorDrawRows(&frame);
+  editorStatusBar(&frame);
+  editorMessageBar(&frame);
+  screenSetAttr(&frame,0);
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  char buf[48];
+  int clen=snprintf(buf, sizeof(buf), "\x1b[%d;%dH%s", (E.cy - E.rowoff) + 1,
+    (E.rx - E.coloff) + 1, frame.len?"\x1b[?25h":"");
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  //hide the cursor only while cells are being rewritten
+  struct iovec iov[3];
+  int iovcnt=0;
+  if(frame.len){
+    iov[iovcnt].iov_base=(void*)"\x1b[?25l";
+    iov[iovcnt++].iov_len=6;
+    iov[iovcnt].iov_base=frame.b;
+    iov[iovcnt++].iov_len=frame.len;
+  }
+  iov[iovcnt].iov_base=buf;
+  iov[iovcnt++].iov_len=clen;
+  E.framebytes=(frame.len?6:0)+frame.len+clen;
+  editorWritev(iov,iovcnt);
 }
 void editorStatusMessage(const char* fmt,...){
   va_list ap;
@@ -705,6 +4527,7 @@ void editorStatusMessage(const char* fmt,...){
   vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
   va_end(ap);
   E.statusmsg_time=time(NULL);
+  L.msg_expire=loopNow()+KILO_MSG_SECS;//redraw once it is gone
 }
 
 /*** input ***/
@@ -716,7 +4539,7 @@ char* editorPrompt(const char*prompt,void(*callback)(char*,int)) {
 
     while (true) {
         editorStatusMessage(prompt,buf);
-        editorRefreshScreen();
+        if(!inputPending())editorFrame();
         int c = editorReadKey();
         if(c==DEL_KEY||c==CTRL_KEY('h')||c==BACKSPACE){
           if(buflen!=0)buf[--buflen]='\0';
@@ -724,19 +4547,27 @@ char* editorPrompt(const char*prompt,void(*callback)(char*,int)) {
             editorStatusMessage("");
             if(callback) callback(buf,c);
             free(buf);
+            return NULL;
         } else if (c == '\r') {
             if (buflen != 0) {
                 editorStatusMessage("");
                 if(callback) callback(buf,c);
                 return buf;
             }
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf=(char*)realloc(buf,bufsize); // Resize buf if only needed
+        } else {
+            //a paste is taken up to its first line break
+            std::string in;
+            if (c == PASTE_KEY) in=IN.paste.substr(0,IN.paste.find_first_of("\r\n"));
+            else if (c < 128) in=(char)c;
+            for (size_t i = 0; i < in.size(); i++) {
+                if (iscntrl((unsigned char)in[i]) && in[i] != '\t') continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf=(char*)realloc(buf,bufsize); // Resize buf if only needed
+                }
+                buf[buflen++] = in[i];
+                buf[buflen] = '\0';
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
         }
         if(callback)callback(buf,c);
     }
@@ -781,20 +4612,24 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
   static int quit_times=KILO_QUIT_TIMES;
   int c = editorReadKey();
+  if(c==REDRAW_KEY)return;
 
   switch (c) {
     case '\r':
     editorInsertNewline();
       break;
     case CTRL_KEY('q'):
+    editorSaveCollect(true);//a running save decides whether anything is unsaved
     if(E.dirty&&quit_times>0){
       editorStatusMessage("WARNING: file has unsaved changes."
       "press Ctril-Q %d one more time to quit.", quit_times);
       quit_times--;
       return;
     }
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
+      {
+        struct iovec clear[2]={{(void*)"\x1b[2J",4},{(void*)"\x1b[H",3}};
+        editorWritev(clear,2);
+      }
       exit(0);
       break;
       case CTRL_KEY('s'):
@@ -812,6 +4647,15 @@ void editorProcessKeypress() {
       case CTRL_KEY('f'):
         editorFind();
         break;
+      case PASTE_KEY:
+        editorInsertText(IN.paste.data(),IN.paste.size());
+        break;
+      case CTRL_KEY('z'):
+        editorUndo();
+        break;
+      case CTRL_KEY('y'):
+        editorRedo();
+        break;
       case BACKSPACE:
       case CTRL_KEY('h'):
         break;
@@ -838,7 +4682,14 @@ void editorProcessKeypress() {
     case ARROW_RIGHT:
       editorMoveCursor(c);
       break;
+#ifndef KILO_NO_PROFILE
+      case CTRL_KEY('p'):
+        profToggle();
+        break;
+#endif
       case CTRL_KEY('l'):
+        E.screen.valid=false;//repaint everything, in case the terminal got garbled
+        break;
       case '\x1b':
         break;
 
@@ -847,7 +4698,7 @@ void editorProcessKeypress() {
         break;
   }
   quit_times=KILO_QUIT_TIMES;
-  
+  undoSeal();
 }
 
 /*** init ***/
@@ -859,27 +4710,96 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
+  E.map=NULL;
+  E.mapsize=0;
+  E.index.paged=false;
+  E.index.lines=0;
+  E.crlf=0;
   E.dirty=0;
+  E.edits=0;
+  E.search.valid=false;
+  E.search.regex=false;
+  E.search.re=NULL;
+  E.search.active=false;
+  E.search.current=-1;
+  E.search.merged=0;
+  E.search.truncated=false;
+  E.search.cancel=false;
+  E.undo.first=E.undo.done=0;
+  E.undo.base=0;
+  editorSetBudget(KILO_MEM_BUDGET);
+  E.undo.step=1;
+  E.undo.skip=0;
+  E.undo.replaying=false;
   E.filename=NULL;
   E.statusmsg[0]='\0';
   E.statusmsg_time=0;
   E.syntax =NULL;//no filetype currently
+  E.hlgen=1;
+  E.hl_last_known=-1;
+  E.hl_async=1;
+  E.search_async=1;
+  E.screen.rows=E.screen.cols=0;
+  E.screen.valid=false;
+  E.framebytes=0;
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) killswitch("getWindowSize");
   E.screenrows-=2;
 }
 
+#ifndef KILO_NO_MAIN//bench.cpp brings its own
 int main(int argc, char *argv[]) {
-  enableRawMode();
+  const char *filename=NULL;
+  size_t budget=KILO_MEM_BUDGET;
+  T.record=-1;
+  T.rows=24;
+  T.cols=80;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      T.record=open(argv[++i],O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+      if (T.record == -1) { perror(argv[i]); return 1; }
+    } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+      if (traceLoad(argv[++i]) == -1) { perror(argv[i]); return 1; }
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &T.rows, &T.cols) != 2 || T.rows < 3 || T.cols < 1) {
+        fprintf(stderr, "--size wants ROWSxCOLS\n");
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--budget") && i + 1 < argc) {
+      long mb = atol(argv[++i]);
+      if (mb < 1) {
+        fprintf(stderr, "--budget wants megabytes\n");
+        return 1;
+      }
+      budget = (size_t)mb << 20;
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (T.replay) {
+    atexit(traceReport);
+  } else {
+    enableRawMode();
+  }
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  editorSetBudget(budget);
+  loopInit();
+  if (T.replay) {
+    L.fps=0;//every frame is drawn and timed
+    E.hl_async=0;//so the frames come out the same on every run
+    E.search_async=0;
+    T.start=loopNow();
+  }
+  if (filename) {
+    editorOpen(filename);
   }
-  editorStatusMessage("HELP:Ctrl-S:save | Ctrl-F=find | Ctrl-Q=quit");
+  editorStatusMessage("HELP:Ctrl-S:save | Ctrl-F=find | Ctrl-Z/Y=undo/redo | Ctrl-Q=quit");
   while (1) {
-    editorRefreshScreen();
+    //keys already typed are handled before drawing, one frame for all of them
+    if(!inputPending())editorFrame();
     editorProcessKeypress();
   }
 
   return 0;
 }
+#endif
@@ -0,0 +1,167 @@
+//tests of the editor core. kilo.cpp is compiled in without its main and
+//every test runs in a child process of its own, as a replay: the keys come
+//from a trace built in memory and the editor draws to the same byte counting
+//sink as --replay. a test fails when a check fails or the child crashes
+#define KILO_NO_MAIN
+#include "kilo.cpp"
+#include <dirent.h>
+#include <sys/wait.h>
+
+std::string testDir;//where the files the tests open go
+int testFailed;
+
+#define CHECK(cond) do{ \
+    if(!(cond)){ \
+      printf("  %s:%d: %s\n",__FILE__,__LINE__,#cond); \
+      testFailed=1; \
+    } \
+  }while(0)
+
+//starts the editor headless on a file holding text. name picks the
+//highlighting, as the extension of a file opened for real does
+void testOpen(const char *name, const std::string &text){
+  std::string path=testDir+"/"+name;
+  FILE *fp=fopen(path.c_str(),"w");
+  if(!fp||fwrite(text.data(),1,text.size(),fp)!=text.size()||fclose(fp)!=0){
+    perror(path.c_str());
+    exit(2);
+  }
+  T.record=-1;
+  T.rows=24;
+  T.cols=80;
+  T.replay=true;
+  initEditor();
+  loopInit();
+  L.fps=0;
+  E.hl_async=0;
+  E.search_async=0;
+  editorOpen(path.c_str());
+}
+//replays a trace of reads, each what one read() of the terminal returned,
+//and handles every key in it the way main does
+void testKeys(std::initializer_list<std::string> reads){
+  T.keys.clear();
+  for(const std::string &r:reads){
+    uint32_t n=r.size();
+    T.keys.append((const char*)&n,sizeof(n));
+    T.keys.append(r);
+  }
+  T.at=0;
+  T.left=0;
+  T.arrived=false;
+  while(!traceDone()||IN.pos<IN.len){
+    if(!inputPending())editorFrame();
+    editorProcessKeypress();
+  }
+  editorFrame();
+}
+std::string testRow(int at){
+  erow &row=E.row[at];
+  return std::string(row.chars.data(),row.size);
+}
+//highlight class of the bytes [from,to) of row at, -1 if they differ
+int testHl(int at, int from, int to){
+  erow *row=editorRenderRow(&E.row[at],editorSyntaxStartState(at));
+  hlspan *sp=editorRowSpans(row);
+  int hl=-1;
+  for(int col=from;col<to;col++){
+    int c=HL_NORMAL;
+    for(int i=0;i<row->nhl;i++)
+      if(col>=sp[i].start&&col<sp[i].start+sp[i].len)c=sp[i].hl;
+    if(hl>=0&&c!=hl)return -1;
+    hl=c;
+  }
+  return hl;
+}
+
+//a page key leaves the cursor past the end of the last line, and a paste
+//there must start at the end of the line instead of splitting it past it
+void testPasteAfterPageDown(){
+  testOpen("paste.txt","");
+  testKeys({"/","\x1b[6~","\x1b[200~a\rb\x1b[201~"});
+  CHECK(E.numrows==3);
+  CHECK(testRow(0)=="/");
+  CHECK(testRow(1)=="a");
+  CHECK(testRow(2)=="b");
+  CHECK(E.cy==2&&E.cx==1);
+}
+//an ESC read on its own is the escape key, not the start of a sequence
+//made of the keys recorded after it
+void testLoneEscape(){
+  testOpen("escape.txt","");
+  testKeys({"\x06","zzz","\x1b","1","2","3"});
+  CHECK(E.numrows==1);
+  CHECK(testRow(0)=="123");
+}
+//a keyword right before a colon is still a keyword: labels in C, access
+//specifiers in C++, the end of a statement head in python
+void testKeywordBeforeColon(){
+  testOpen("colon.cpp","switch (x) {\ndefault: break;\n}\nclass A {\npublic:\n};\n");
+  CHECK(testHl(1,0,7)==HL_KEYWORD1);
+  CHECK(testHl(1,7,8)==HL_NORMAL);
+  CHECK(testHl(4,0,6)==HL_KEYWORD1);
+  testOpen("colon.py","if x:\n    pass\nelse:\n    pass\n");
+  CHECK(testHl(2,0,4)==HL_KEYWORD1);
+}
+
+struct testCase {
+  const char *name;
+  void (*fn)();
+};
+const testCase tests[]={
+  {"paste_after_page_down",testPasteAfterPageDown},
+  {"lone_escape",testLoneEscape},
+  {"keyword_before_colon",testKeywordBeforeColon},
+};
+
+bool testRun(const testCase &t){
+  fflush(stdout);
+  pid_t pid=fork();
+  if(pid==-1){
+    perror("fork");
+    exit(2);
+  }
+  if(pid==0){
+    testFailed=0;
+    t.fn();
+    fflush(stdout);
+    _exit(testFailed);
+  }
+  int status;
+  while(waitpid(pid,&status,0)==-1&&errno==EINTR);
+  bool ok=WIFEXITED(status)&&WEXITSTATUS(status)==0;
+  if(WIFSIGNALED(status))printf("  killed by signal %d\n",WTERMSIG(status));
+  printf("%-32s %s\n",t.name,ok?"ok":"FAILED");
+  return ok;
+}
+
+//removes testDir and the files the tests left in it
+void testClean(){
+  DIR *d=opendir(testDir.c_str());
+  if(!d)return;
+  while(struct dirent *e=readdir(d)){
+    if(e->d_name[0]!='.')unlink((testDir+"/"+e->d_name).c_str());
+  }
+  closedir(d);
+  rmdir(testDir.c_str());
+}
+
+int main(int argc, char **argv){
+  char dir[]="/tmp/kilo-test-XXXXXX";
+  if(!mkdtemp(dir)){
+    perror("mkdtemp");
+    return 2;
+  }
+  testDir=dir;
+  int failed=0,run=0;
+  for(const testCase &t:tests){
+    bool wanted=argc<2;
+    for(int i=1;i<argc;i++)if(!strcmp(argv[i],t.name))wanted=true;
+    if(!wanted)continue;
+    run++;
+    if(!testRun(t))failed++;
+  }
+  testClean();
+  printf("%d of %d tests failed\n",failed,run);
+  return failed?1:0;
+}